@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measures the throughput of cat (../bin/cat by default) copying a large
+// file into each kind of output it treats differently:
+//
+//   file   a regular file on the same file system as the input
+//   pipe   a pipe, drained by this driver (with splice () into /dev/null,
+//          so the reader costs next to nothing)
+//   null   /dev/null
+//
+// Prints one CSV line per output:
+//
+//   sink,bytes,trials,best_gbps,p50_gbps
+//
+// The input is written once and read once before the trials, so it is
+// in the page cache and the numbers measure copying, not the disk. GB/s
+// are 1e9 bytes per second of wall time from spawn to reaped child.
+
+#define DEFAULT_MIB 256
+#define DEFAULT_TRIALS 5
+
+extern char **environ;
+
+typedef enum
+{
+  SINK_FILE,
+  SINK_PIPE,
+  SINK_NULL
+} sink_t;
+
+static const char *const sink_names[] = { "file", "pipe", "null" };
+
+#define NUM_SINKS (sizeof (sink_names) / sizeof (sink_names[0]))
+
+static double
+now_s (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Writes size bytes of varied data (NULs and long lines included) to
+   path. Returns false on failure. */
+static bool
+make_input (const char *path, size_t size)
+{
+  int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    return false;
+  char block[65536];
+  unsigned state = 12345;
+  for (size_t i = 0; i < sizeof (block); i++)
+    {
+      state = state * 1103515245 + 12345;
+      block[i] = (char)(state >> 16);
+    }
+  bool ok = true;
+  for (size_t done = 0; ok && done < size;)
+    {
+      size_t n = (size - done < sizeof (block)) ? size - done
+                                                : sizeof (block);
+      ssize_t put = write (fd, block, n);
+      ok = (put > 0);
+      done += (put > 0) ? (size_t)put : 0;
+    }
+  close (fd);
+  return ok;
+}
+
+/* Empties a pipe into /dev/null until its writer closes it. Returns the
+   number of bytes read. */
+static size_t
+drain (int pipe_fd, int null)
+{
+  size_t total = 0;
+  while (true)
+    {
+      ssize_t n
+          = splice (pipe_fd, NULL, null, NULL, 1 << 30, SPLICE_F_MOVE);
+      if (n > 0)
+        {
+          total += n;
+          continue;
+        }
+      if (n == 0 || errno != EINTR)
+        break;
+    }
+  return total;
+}
+
+/* Runs cat on input once with its output sent to sink. Returns the
+   seconds it took, or -1 on failure. */
+static double
+run_trial (const char *cat, const char *input, const char *output,
+           sink_t sink, size_t size)
+{
+  int out = -1;
+  int pipe_fds[2] = { -1, -1 };
+  int null = open ("/dev/null", O_WRONLY);
+  if (sink == SINK_FILE)
+    out = open (output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  else if (sink == SINK_PIPE && pipe (pipe_fds) == 0)
+    out = pipe_fds[1];
+  else if (sink == SINK_NULL)
+    out = dup (null);
+  if (out == -1 || null == -1)
+    {
+      if (null != -1)
+        close (null);
+      return -1;
+    }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_adddup2 (&actions, out, STDOUT_FILENO);
+  if (pipe_fds[0] != -1)
+    posix_spawn_file_actions_addclose (&actions, pipe_fds[0]);
+  char *argv[] = { "cat", (char *)input, NULL };
+
+  double start = now_s ();
+  pid_t pid;
+  int err = posix_spawn (&pid, cat, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy (&actions);
+  close (out);
+  size_t drained = size;
+  if (err == 0 && sink == SINK_PIPE)
+    drained = drain (pipe_fds[0], null);
+  int status = 1;
+  if (err == 0)
+    waitpid (pid, &status, 0);
+  double end = now_s ();
+
+  if (pipe_fds[0] != -1)
+    close (pipe_fds[0]);
+  close (null);
+  if (err != 0 || !WIFEXITED (status) || WEXITSTATUS (status) != 0
+      || drained != size)
+    return -1;
+  if (sink == SINK_FILE)
+    {
+      struct stat st;
+      if (stat (output, &st) == -1 || (size_t)st.st_size != size)
+        return -1;
+    }
+  return end - start;
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr,
+           "Usage: %s [-m MiB] [-t trials] [-c cat] [-d dir]\n"
+           "-d is where the input and output files go (default /tmp)\n",
+           name);
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t mib = DEFAULT_MIB;
+  int trials = DEFAULT_TRIALS;
+  const char *cat = "../bin/cat";
+  const char *where = "/tmp";
+  int opt;
+  while ((opt = getopt (argc, argv, "m:t:c:d:h")) != -1)
+    switch (opt)
+      {
+      case 'm':
+        mib = strtoul (optarg, NULL, 10);
+        break;
+      case 't':
+        trials = atoi (optarg);
+        break;
+      case 'c':
+        cat = optarg;
+        break;
+      case 'd':
+        where = optarg;
+        break;
+      default:
+        usage (argv[0]);
+        return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+  if (mib == 0 || trials < 1)
+    {
+      usage (argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  char cat_path[PATH_MAX];
+  if (realpath (cat, cat_path) == NULL)
+    {
+      perror (cat);
+      return EXIT_FAILURE;
+    }
+
+  char input[PATH_MAX];
+  char output[PATH_MAX];
+  snprintf (input, sizeof (input), "%s/cat-bench-in.%d", where,
+            (int)getpid ());
+  snprintf (output, sizeof (output), "%s/cat-bench-out.%d", where,
+            (int)getpid ());
+  size_t size = mib << 20;
+  if (!make_input (input, size))
+    {
+      perror (input);
+      unlink (input);
+      return EXIT_FAILURE;
+    }
+
+  printf ("sink,bytes,trials,best_gbps,p50_gbps\n");
+  int rc = EXIT_SUCCESS;
+  double *rates = malloc (trials * sizeof (double));
+  for (size_t s = 0; s < NUM_SINKS; s++)
+    {
+      // One untimed run warms the page cache and the binary
+      bool ok = run_trial (cat_path, input, output, s, size) > 0;
+      for (int t = 0; t < trials && ok; t++)
+        {
+          double secs = run_trial (cat_path, input, output, s, size);
+          ok = (secs > 0);
+          rates[t] = ok ? size / secs / 1e9 : 0;
+        }
+      unlink (output);
+      if (!ok)
+        {
+          fprintf (stderr, "%s: cat failed\n", sink_names[s]);
+          rc = EXIT_FAILURE;
+          continue;
+        }
+      qsort (rates, trials, sizeof (double), compare);
+      printf ("%s,%zu,%d,%.2f,%.2f\n", sink_names[s], size, trials,
+              rates[trials - 1], rates[trials / 2]);
+      fflush (stdout);
+    }
+
+  free (rates);
+  unlink (input);
+  return rc;
+}
@@ -0,0 +1,418 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/hash.h"
+
+// Times hash_insert, hash_find, hash_remove and hash_keys under a few
+// workloads modelled on what the shell does with its variables, and
+// prints one CSV line per workload and operation:
+//
+//   workload,op,count,ns_per_op,p50_ns,p99_ns,allocs_per_op,frees_per_op
+//
+// Every call is timed on its own; the cost of reading the clock is
+// measured first and subtracted. Allocations are counted by wrapping
+// malloc and friends at link time (see the Makefile), so the numbers
+// only cover calls made by hash.c and this file.
+//
+// Workloads:
+//   hot    a handful of variables; every "command" sets ? and PIPESTATUS
+//          and reads PATH and HOME, and the environment is rebuilt from
+//          hash_keys () every few commands
+//   large  20000 variables, mostly lookups (hits and misses) and updates
+//   churn  the table size swings between 100 and 5000 entries, with
+//          removes outnumbering inserts on the way down, so every grow
+//          and shrink threshold is crossed many times
+//   long   2000 keys of 64-255 characters with values of 100-1000, and
+//          updates that change the value length
+
+#define DEFAULT_OPS 200000
+#define MAX_LONG_VALUE 1000
+
+void *__real_malloc (size_t);
+void *__real_calloc (size_t, size_t);
+void *__real_realloc (void *, size_t);
+void __real_free (void *);
+
+static size_t allocs = 0;
+static size_t frees = 0;
+
+void *
+__wrap_malloc (size_t size)
+{
+  allocs++;
+  return __real_malloc (size);
+}
+
+void *
+__wrap_calloc (size_t nmemb, size_t size)
+{
+  allocs++;
+  return __real_calloc (nmemb, size);
+}
+
+void *
+__wrap_realloc (void *ptr, size_t size)
+{
+  allocs++;
+  return __real_realloc (ptr, size);
+}
+
+void
+__wrap_free (void *ptr)
+{
+  if (ptr != NULL)
+    frees++;
+  __real_free (ptr);
+}
+
+typedef enum
+{
+  OP_INSERT,
+  OP_FIND,
+  OP_REMOVE,
+  OP_KEYS,
+  NUM_OPS
+} op_t;
+
+static const char *op_names[] = { "insert", "find", "remove", "keys" };
+
+// Samples of one operation in the current workload
+typedef struct samples
+{
+  double *ns;
+  size_t count;
+  size_t allocs;
+  size_t frees;
+} samples_t;
+
+static samples_t samples[NUM_OPS];
+static size_t max_samples;
+static double clock_cost; // ns taken by the timer itself
+static hash_t *table;
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Median time of an empty timed region */
+static double
+calibrate (void)
+{
+  size_t n = 10000;
+  double *ns = malloc (n * sizeof (double));
+  for (size_t i = 0; i < n; i++)
+    {
+      double start = now_ns ();
+      ns[i] = now_ns () - start;
+    }
+  qsort (ns, n, sizeof (double), compare);
+  double median = ns[n / 2];
+  free (ns);
+  return median;
+}
+
+/* Runs one operation and records its time and allocations */
+static void
+timed (op_t op, char *key, char *value)
+{
+  samples_t *s = &samples[op];
+  if (s->count == max_samples)
+    return;
+
+  size_t a = allocs;
+  size_t f = frees;
+  char **keys = NULL;
+  double start = now_ns ();
+  switch (op)
+    {
+    case OP_INSERT:
+      hash_insert (table, key, value);
+      break;
+    case OP_FIND:
+      hash_find (table, key);
+      break;
+    case OP_REMOVE:
+      hash_remove (table, key);
+      break;
+    default:
+      keys = hash_keys (table);
+      free (keys);
+      break;
+    }
+  double ns = now_ns () - start - clock_cost;
+  s->ns[s->count++] = (ns > 0) ? ns : 0;
+  s->allocs += allocs - a;
+  s->frees += frees - f;
+}
+
+static void
+report (const char *workload)
+{
+  for (int op = 0; op < NUM_OPS; op++)
+    {
+      samples_t *s = &samples[op];
+      if (s->count == 0)
+        continue;
+
+      double total = 0;
+      for (size_t i = 0; i < s->count; i++)
+        total += s->ns[i];
+      qsort (s->ns, s->count, sizeof (double), compare);
+      printf ("%s,%s,%zu,%.1f,%.0f,%.0f,%.4f,%.4f\n", workload,
+              op_names[op], s->count, total / s->count,
+              s->ns[s->count / 2], s->ns[(size_t)(s->count * 0.99)],
+              (double)s->allocs / s->count, (double)s->frees / s->count);
+      s->count = s->allocs = s->frees = 0;
+    }
+}
+
+/* Returns n keys named prefix0, prefix1, ... */
+static char **
+make_keys (const char *prefix, size_t n)
+{
+  char **keys = malloc (n * sizeof (char *));
+  char buffer[64];
+  for (size_t i = 0; i < n; i++)
+    {
+      snprintf (buffer, sizeof (buffer), "%s%zu", prefix, i);
+      keys[i] = strdup (buffer);
+    }
+  return keys;
+}
+
+static void
+free_keys (char **keys, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    free (keys[i]);
+  free (keys);
+}
+
+static void
+hot (size_t ops)
+{
+  static char *env[] = { "PATH", "HOME",   "USER",  "SHELL",  "TERM",
+                         "LANG", "PWD",    "EDITOR", "PAGER", "TMPDIR",
+                         "LOGNAME", "HOSTNAME" };
+  static char *codes[] = { "0", "0", "0", "1", "0", "127" };
+  static char *pipes[] = { "0", "0 0", "0 1 0", "1", "0 0 0 0", "127" };
+  size_t nenv = sizeof (env) / sizeof (env[0]);
+
+  table = hash_new (100);
+  hash_insert (table, "?", "0");
+  for (size_t i = 0; i < nenv; i++)
+    hash_insert (table, env[i], "/usr/local/bin:/usr/bin:/bin");
+
+  for (size_t cmd = 0; cmd * 4 < ops; cmd++)
+    {
+      timed (OP_FIND, "PATH", NULL);
+      timed (OP_FIND, "HOME", NULL);
+      if (cmd % 8 == 0)
+        timed (OP_KEYS, NULL, NULL);
+      timed (OP_INSERT, "PIPESTATUS", pipes[cmd % 6]);
+      timed (OP_INSERT, "?", codes[cmd % 6]);
+    }
+  hash_free (table);
+  report ("hot");
+}
+
+static void
+large (size_t ops)
+{
+  size_t nkeys = 20000;
+  char **keys = make_keys ("VARIABLE_", nkeys);
+  char **misses = make_keys ("MISSING_", nkeys);
+  char **extra = make_keys ("EXTRA_", nkeys);
+
+  table = hash_new (100);
+  for (size_t i = 0; i < nkeys; i++)
+    hash_insert (table, keys[i], "initial value");
+
+  size_t next_extra = 0;
+  for (size_t i = 0; i < ops; i++)
+    {
+      int r = rand () % 100;
+      if (r < 70)
+        timed (OP_FIND, keys[rand () % nkeys], NULL);
+      else if (r < 80)
+        timed (OP_FIND, misses[rand () % nkeys], NULL);
+      else if (r < 95)
+        timed (OP_INSERT, keys[rand () % nkeys], (r & 1) ? "odd" : "even");
+      else if (r & 1)
+        timed (OP_INSERT, extra[next_extra++ % nkeys], "new");
+      else
+        timed (OP_REMOVE, extra[rand () % nkeys], NULL);
+      if (i % 1000 == 0)
+        timed (OP_KEYS, NULL, NULL);
+    }
+  hash_free (table);
+  free_keys (keys, nkeys);
+  free_keys (misses, nkeys);
+  free_keys (extra, nkeys);
+  report ("large");
+}
+
+static void
+churn (size_t ops)
+{
+  size_t nkeys = 5000;
+  size_t low = 100;
+  char **keys = make_keys ("K", nkeys);
+  bool *present = calloc (nkeys, sizeof (bool));
+  size_t size = 0;
+  bool growing = true;
+
+  table = hash_new (100);
+  for (size_t i = 0; i < ops; i++)
+    {
+      if (growing && size >= nkeys * 9 / 10)
+        growing = false;
+      else if (!growing && size <= low)
+        growing = true;
+
+      // 70% of the operations move the size in the current direction
+      bool insert = ((rand () % 100) < 70) == growing;
+      size_t k = rand () % nkeys;
+      if (insert && !present[k])
+        {
+          timed (OP_INSERT, keys[k], "value");
+          present[k] = true;
+          size++;
+        }
+      else if (!insert && present[k])
+        {
+          timed (OP_REMOVE, keys[k], NULL);
+          present[k] = false;
+          size--;
+        }
+      else
+        timed (OP_FIND, keys[k], NULL);
+    }
+  hash_free (table);
+  free (present);
+  free_keys (keys, nkeys);
+  report ("churn");
+}
+
+static void
+long_keys (size_t ops)
+{
+  size_t nkeys = 2000;
+  char **keys = malloc (nkeys * sizeof (char *));
+  for (size_t i = 0; i < nkeys; i++)
+    {
+      size_t len = 64 + rand () % 192;
+      keys[i] = malloc (len + 1);
+      int n = snprintf (keys[i], len + 1, "%zu_", i);
+      memset (keys[i] + n, 'k', len - n);
+      keys[i][len] = '\0';
+    }
+  char *value = malloc (MAX_LONG_VALUE + 1);
+  memset (value, 'v', MAX_LONG_VALUE);
+  value[MAX_LONG_VALUE] = '\0';
+
+  // Values are suffixes of one long string, so their length varies
+  table = hash_new (100);
+  for (size_t i = 0; i < nkeys; i += 2)
+    hash_insert (table, keys[i], value + rand () % 900);
+
+  for (size_t i = 0; i < ops; i++)
+    {
+      int r = rand () % 100;
+      char *key = keys[rand () % nkeys];
+      if (r < 50)
+        timed (OP_FIND, key, NULL);
+      else if (r < 90)
+        timed (OP_INSERT, key, value + rand () % 900);
+      else
+        timed (OP_REMOVE, key, NULL);
+    }
+  hash_free (table);
+  free (value);
+  free_keys (keys, nkeys);
+  report ("long");
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr, "Usage: %s [-n ops] [-s seed] [-w workload]\n", name);
+  fprintf (stderr, "Workloads: hot, large, churn, long (default: all)\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t ops = DEFAULT_OPS;
+  unsigned seed = 1;
+  const char *only = NULL;
+  int opt;
+  while ((opt = getopt (argc, argv, "n:s:w:h")) != -1)
+    switch (opt)
+      {
+      case 'n':
+        ops = strtoul (optarg, NULL, 10);
+        break;
+      case 's':
+        seed = strtoul (optarg, NULL, 10);
+        break;
+      case 'w':
+        only = optarg;
+        break;
+      default:
+        usage (argv[0]);
+        return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+
+  // keys can be timed once per 1000 operations on top of ops
+  max_samples = ops + ops / 1000 + 1;
+  for (int op = 0; op < NUM_OPS; op++)
+    samples[op].ns = malloc (max_samples * sizeof (double));
+  clock_cost = calibrate ();
+  srand (seed);
+
+  struct
+  {
+    const char *name;
+    void (*run) (size_t);
+  } workloads[] = { { "hot", hot },
+                    { "large", large },
+                    { "churn", churn },
+                    { "long", long_keys } };
+
+  printf ("workload,op,count,ns_per_op,p50_ns,p99_ns,allocs_per_op,"
+          "frees_per_op\n");
+  bool found = false;
+  for (size_t i = 0; i < sizeof (workloads) / sizeof (workloads[0]); i++)
+    if (only == NULL || !strcmp (only, workloads[i].name))
+      {
+        workloads[i].run (ops);
+        found = true;
+      }
+
+  for (int op = 0; op < NUM_OPS; op++)
+    free (samples[op].ns);
+  if (!found)
+    {
+      usage (argv[0]);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,138 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/hash.h"
+
+// Measures the latency of every single hash_insert and hash_remove call
+// while the table grows, shrinks, and sits at a resize threshold, then
+// prints percentiles per phase. Resizing used to make one call in a few
+// thousand walk the whole table; the p99.9 and max columns show whether
+// that cost is spread across calls.
+
+#define DEFAULT_KEYS 200000
+
+static hash_t *table;
+static double *samples;
+static size_t nsamples;
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double
+percentile (double p)
+{
+  size_t index = (size_t)(p / 100.0 * (nsamples - 1));
+  return samples[index];
+}
+
+static void
+report (const char *phase)
+{
+  qsort (samples, nsamples, sizeof (double), compare);
+  printf ("%-16s %9zu %9.0f %9.0f %9.0f %9.0f %11.0f\n", phase, nsamples,
+          percentile (50), percentile (99), percentile (99.9),
+          percentile (99.99), samples[nsamples - 1]);
+  nsamples = 0;
+}
+
+static void
+timed_insert (char *key, char *value)
+{
+  double start = now_ns ();
+  hash_insert (table, key, value);
+  samples[nsamples++] = now_ns () - start;
+}
+
+static void
+timed_remove (char *key)
+{
+  double start = now_ns ();
+  hash_remove (table, key);
+  samples[nsamples++] = now_ns () - start;
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t keys = DEFAULT_KEYS;
+  int opt;
+  while ((opt = getopt (argc, argv, "n:h")) != -1)
+    switch (opt)
+      {
+      case 'n':
+        keys = strtoul (optarg, NULL, 10);
+        break;
+      default:
+        fprintf (stderr, "Usage: %s [-n keys]\n", argv[0]);
+        return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+  if (keys == 0)
+    keys = 1;
+
+  samples = malloc (2 * keys * sizeof (double));
+  char key[32];
+
+  printf ("%-16s %9s %9s %9s %9s %9s %11s\n", "phase (ns)", "ops", "p50",
+          "p99", "p99.9", "p99.99", "max");
+  table = hash_new (100);
+
+  // Every insert adds a key, so the table passes each growth threshold
+  for (size_t i = 0; i < keys; i++)
+    {
+      snprintf (key, sizeof (key), "VAR%zu", i);
+      timed_insert (key, "value");
+    }
+  report ("insert (grow)");
+
+  // Overwriting keeps the size fixed
+  for (size_t i = 0; i < keys; i++)
+    {
+      snprintf (key, sizeof (key), "VAR%zu", i);
+      timed_insert (key, (i & 1) ? "odd" : "even");
+    }
+  report ("insert (update)");
+
+  // Removing everything passes each shrink threshold
+  for (size_t i = 0; i < keys; i++)
+    {
+      snprintf (key, sizeof (key), "VAR%zu", i);
+      timed_remove (key);
+    }
+  report ("remove (shrink)");
+
+  // Fill to just below a growth threshold, then add and remove one key
+  // over and over, as an export/unset loop in a script would
+  size_t fill = 0;
+  while (fill < 64)
+    {
+      snprintf (key, sizeof (key), "VAR%zu", fill++);
+      hash_insert (table, key, "value");
+    }
+  for (size_t i = 0; i < keys; i++)
+    {
+      timed_insert ("EDGE", "value");
+      timed_remove ("EDGE");
+    }
+  report ("insert/remove");
+
+  hash_free (table);
+  free (samples);
+  return EXIT_SUCCESS;
+}
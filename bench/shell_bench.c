@@ -0,0 +1,452 @@
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs dukesh on generated -b scripts and prints one CSV line per
+// workload:
+//
+//   workload,commands,trials,cmds_per_sec,p50_us,p90_us,p99_us,max_us,
+//   max_rss_kb
+//
+// The shell runs on a pseudo-terminal, so its stdout is line buffered and
+// the "$ command" line it echoes reaches the driver as the command
+// starts. The time between two of those lines is the latency of one
+// command, launch included; commands that finish before the driver
+// gets to read the previous line show up as 0. cmds_per_sec is the
+// median over the trials and max_rss_kb the largest peak RSS of the
+// shell process (from wait4 ()); the commands it runs are not included.
+//
+// Workloads:
+//   builtin   export, echo, unset and pwd only; no process is started
+//   external  cat on small files, one process per command
+//   pipe2     two-stage pipelines (cat | head)
+//   pipe8     eight-stage pipelines
+//   longargs  echo and cat with a few hundred arguments per line
+//
+// Everything runs against the utilities in utils/ (built into ../bin by
+// default), so the suite needs nothing outside the repository.
+
+#define DEFAULT_COMMANDS 2000
+#define DEFAULT_TRIALS 5
+#define LONG_ARGS 300
+
+typedef struct context
+{
+  const char *bin;  // absolute path of the utilities
+  const char *data; // directory of the generated files
+} context_t;
+
+typedef struct workload
+{
+  const char *name;
+  void (*generate) (FILE *, size_t, const context_t *);
+} workload_t;
+
+static void
+gen_builtin (FILE *script, size_t n, const context_t *ctx)
+{
+  (void)ctx;
+  for (size_t i = 0; i < n; i++)
+    switch (i % 4)
+      {
+      case 0:
+        fprintf (script, "export VAR%zu=value%zu\n", i % 64, i);
+        break;
+      case 1:
+        fprintf (script, "echo hello world %zu\n", i);
+        break;
+      case 2:
+        fprintf (script, "unset VAR%zu\n", (i + 32) % 64);
+        break;
+      default:
+        fprintf (script, "pwd\n");
+        break;
+      }
+}
+
+static void
+gen_external (FILE *script, size_t n, const context_t *ctx)
+{
+  for (size_t i = 0; i < n; i++)
+    fprintf (script, "%s/cat %s/small%zu.txt\n", ctx->bin, ctx->data, i % 8);
+}
+
+static void
+gen_pipe2 (FILE *script, size_t n, const context_t *ctx)
+{
+  for (size_t i = 0; i < n; i++)
+    fprintf (script, "%s/cat %s/table.csv | %s/head -n 2\n", ctx->bin,
+             ctx->data, ctx->bin);
+}
+
+static void
+gen_pipe8 (FILE *script, size_t n, const context_t *ctx)
+{
+  const char *b = ctx->bin;
+  for (size_t i = 0; i < n; i++)
+    fprintf (script,
+             "%s/cat %s/table.csv | %s/cat | %s/head -n 50 | %s/cat"
+             " | %s/cut -d , -f 2 | %s/cat | %s/head -n 3 | %s/cat\n",
+             b, ctx->data, b, b, b, b, b, b, b);
+}
+
+static void
+gen_longargs (FILE *script, size_t n, const context_t *ctx)
+{
+  for (size_t i = 0; i < n; i++)
+    {
+      if (i % 2 == 0)
+        fprintf (script, "echo");
+      else
+        fprintf (script, "%s/cat %s/small0.txt", ctx->bin, ctx->data);
+      for (size_t a = 0; a < LONG_ARGS; a++)
+        fprintf (script, " argument%zu", a);
+      fprintf (script, "\n");
+    }
+}
+
+static workload_t workloads[] = { { "builtin", gen_builtin },
+                                  { "external", gen_external },
+                                  { "pipe2", gen_pipe2 },
+                                  { "pipe8", gen_pipe8 },
+                                  { "longargs", gen_longargs } };
+
+#define NUM_WORKLOADS (sizeof (workloads) / sizeof (workloads[0]))
+
+static double
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Creates the files the scripts read */
+static bool
+make_data (const char *dir)
+{
+  char path[PATH_MAX];
+  for (int i = 0; i < 8; i++)
+    {
+      snprintf (path, sizeof (path), "%s/small%d.txt", dir, i);
+      FILE *f = fopen (path, "w");
+      if (f == NULL)
+        return false;
+      fprintf (f, "small file %d\nsecond line\n", i);
+      fclose (f);
+    }
+
+  snprintf (path, sizeof (path), "%s/table.csv", dir);
+  FILE *f = fopen (path, "w");
+  if (f == NULL)
+    return false;
+  for (int i = 0; i < 200; i++)
+    fprintf (f, "%d,name%d,%d\n", i, i, i * i);
+  fclose (f);
+  return true;
+}
+
+static void
+remove_data (const char *dir)
+{
+  char path[PATH_MAX];
+  for (int i = 0; i < 8; i++)
+    {
+      snprintf (path, sizeof (path), "%s/small%d.txt", dir, i);
+      unlink (path);
+    }
+  snprintf (path, sizeof (path), "%s/table.csv", dir);
+  unlink (path);
+  rmdir (dir);
+}
+
+/* Opens a pseudo-terminal with output processing and echo turned off,
+   so the driver reads exactly what the shell writes. Returns the master
+   and stores the slave in *slave. */
+static int
+open_pty (int *slave)
+{
+  int master = posix_openpt (O_RDWR | O_NOCTTY);
+  if (master == -1 || grantpt (master) == -1 || unlockpt (master) == -1)
+    return -1;
+
+  if ((*slave = open (ptsname (master), O_RDWR | O_NOCTTY)) == -1)
+    {
+      close (master);
+      return -1;
+    }
+  struct termios tio;
+  if (tcgetattr (*slave, &tio) == 0)
+    {
+      tio.c_oflag &= ~OPOST;
+      tio.c_lflag &= ~(ECHO | ICANON);
+      tcsetattr (*slave, TCSANOW, &tio);
+    }
+  return master;
+}
+
+/* Runs the shell on a script once. Appends the latency of each command
+   to latencies (growing it as needed) and returns the wall time in
+   microseconds, or -1 on failure. */
+static double
+run_trial (const char *shell, const char *script, bool cache,
+           double **latencies, size_t *count, size_t *cap, long *max_rss)
+{
+  int slave;
+  int master = open_pty (&slave);
+  if (master == -1)
+    {
+      perror ("pty");
+      return -1;
+    }
+
+  double start = now_us ();
+  pid_t pid = fork ();
+  if (pid == -1)
+    {
+      perror ("fork");
+      close (master);
+      close (slave);
+      return -1;
+    }
+  if (pid == 0)
+    {
+      int null = open ("/dev/null", O_RDONLY);
+      if (null == -1)
+        _exit (127);
+      dup2 (null, STDIN_FILENO);
+      dup2 (slave, STDOUT_FILENO);
+      dup2 (slave, STDERR_FILENO);
+      close (slave);
+      close (master);
+      if (cache)
+        execl (shell, shell, "-b", script, (char *)NULL);
+      else
+        execl (shell, shell, "--no-cache", "-b", script, (char *)NULL);
+      _exit (127);
+    }
+
+  // The child has the slave open now; once it (and every process it
+  // started) exits, reading the master fails with EIO
+  close (slave);
+
+  // Every line starting with "$ " marks the start of a command
+  char buffer[65536];
+  bool line_start = true;
+  bool dollar = false;
+  double last = -1;
+  ssize_t got;
+  while ((got = read (master, buffer, sizeof (buffer))) > 0
+         || (got == -1 && errno == EINTR))
+    {
+      double t = now_us ();
+      for (ssize_t i = 0; i < got; i++)
+        {
+          char c = buffer[i];
+          if (dollar && c == ' ')
+            {
+              if (last >= 0)
+                {
+                  if (*count == *cap)
+                    {
+                      *cap = (*cap == 0) ? 4096 : *cap * 2;
+                      *latencies
+                          = realloc (*latencies, *cap * sizeof (double));
+                    }
+                  (*latencies)[(*count)++] = t - last;
+                }
+              last = t;
+            }
+          dollar = line_start && c == '$';
+          line_start = (c == '\n');
+        }
+    }
+  close (master);
+
+  int status;
+  struct rusage usage;
+  if (wait4 (pid, &status, 0, &usage) == -1)
+    return -1;
+  double end = now_us ();
+  if (last >= 0)
+    {
+      if (*count == *cap)
+        {
+          *cap = (*cap == 0) ? 4096 : *cap * 2;
+          *latencies = realloc (*latencies, *cap * sizeof (double));
+        }
+      (*latencies)[(*count)++] = end - last;
+    }
+  if (usage.ru_maxrss > *max_rss)
+    *max_rss = usage.ru_maxrss;
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    return -1;
+  return end - start;
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr,
+           "Usage: %s [-n commands] [-t trials] [-s dukesh] [-B bindir]\n"
+           "       [-w workload] [-C]\n"
+           "Workloads: builtin, external, pipe2, pipe8, longargs"
+           " (default: all)\n"
+           "-C runs the scripts with --no-cache\n",
+           name);
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t commands = DEFAULT_COMMANDS;
+  int trials = DEFAULT_TRIALS;
+  const char *shell = "./dukesh";
+  const char *bindir = "../bin";
+  const char *only = NULL;
+  bool cache = true;
+  int opt;
+  while ((opt = getopt (argc, argv, "n:t:s:B:w:Ch")) != -1)
+    switch (opt)
+      {
+      case 'n':
+        commands = strtoul (optarg, NULL, 10);
+        break;
+      case 't':
+        trials = atoi (optarg);
+        break;
+      case 's':
+        shell = optarg;
+        break;
+      case 'B':
+        bindir = optarg;
+        break;
+      case 'w':
+        only = optarg;
+        break;
+      case 'C':
+        cache = false;
+        break;
+      default:
+        usage (argv[0]);
+        return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+  if (commands == 0 || trials < 1)
+    {
+      usage (argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  char bin[PATH_MAX];
+  char shell_path[PATH_MAX];
+  if (realpath (bindir, bin) == NULL)
+    {
+      perror (bindir);
+      return EXIT_FAILURE;
+    }
+  if (realpath (shell, shell_path) == NULL)
+    {
+      perror (shell);
+      return EXIT_FAILURE;
+    }
+
+  char dir[] = "/tmp/dukesh-bench-XXXXXX";
+  if (mkdtemp (dir) == NULL || !make_data (dir))
+    {
+      perror ("data");
+      return EXIT_FAILURE;
+    }
+  context_t ctx = { bin, dir };
+
+  printf ("workload,commands,trials,cmds_per_sec,p50_us,p90_us,p99_us,"
+          "max_us,max_rss_kb\n");
+  int rc = EXIT_SUCCESS;
+  bool found = false;
+  for (size_t w = 0; w < NUM_WORKLOADS; w++)
+    {
+      if (only != NULL && strcmp (only, workloads[w].name))
+        continue;
+      found = true;
+
+      char script[PATH_MAX];
+      char cached[PATH_MAX];
+      snprintf (script, sizeof (script), "%s/%s.sh", dir,
+                workloads[w].name);
+      snprintf (cached, sizeof (cached), "%s/.%s.sh.dkc", dir,
+                workloads[w].name);
+      FILE *f = fopen (script, "w");
+      if (f == NULL)
+        {
+          perror (script);
+          rc = EXIT_FAILURE;
+          break;
+        }
+      workloads[w].generate (f, commands, &ctx);
+      fclose (f);
+
+      double *latencies = NULL;
+      size_t count = 0;
+      size_t cap = 0;
+      long max_rss = 0;
+      double *rates = malloc (trials * sizeof (double));
+      bool ok = true;
+      for (int t = 0; t < trials && ok; t++)
+        {
+          double us = run_trial (shell_path, script, cache, &latencies,
+                                 &count, &cap, &max_rss);
+          ok = (us > 0);
+          rates[t] = ok ? commands / (us / 1e6) : 0;
+        }
+
+      if (ok && count > 0)
+        {
+          qsort (rates, trials, sizeof (double), compare);
+          qsort (latencies, count, sizeof (double), compare);
+          printf ("%s,%zu,%d,%.0f,%.1f,%.1f,%.1f,%.1f,%ld\n",
+                  workloads[w].name, commands, trials, rates[trials / 2],
+                  latencies[count / 2], latencies[(size_t)(count * 0.90)],
+                  latencies[(size_t)(count * 0.99)], latencies[count - 1],
+                  max_rss);
+          fflush (stdout);
+        }
+      else
+        {
+          fprintf (stderr, "%s: the shell failed\n", workloads[w].name);
+          rc = EXIT_FAILURE;
+        }
+
+      free (rates);
+      free (latencies);
+      unlink (script);
+      unlink (cached);
+    }
+
+  remove_data (dir);
+  if (!found)
+    {
+      usage (argv[0]);
+      return EXIT_FAILURE;
+    }
+  return rc;
+}
@@ -0,0 +1,291 @@
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compares the startup latency of the separate utility binaries (../bin/
+// cat, ...) with the multicall binary run through its links
+// (../bin/multi/cat, ..., see ../utils/dukeutils.c). Both are linked
+// dynamically, as "make -C ../utils" builds them. When the static
+// multicall build is there too ("make -C ../utils static", links in
+// ../bin/multi-static/), it is reported as a third variant, so the gain
+// of static linking is not mixed into the multicall numbers.
+//
+// Each invocation is a posix_spawn () and a wait, with the output sent
+// to /dev/null, so its time is dominated by exec, dynamic linking and
+// process teardown. The variants take turns, so all of them see the
+// same machine state.
+//
+// Prints one CSV line per utility and variant:
+//
+//   util,variant,runs,p50_us,p90_us,p99_us,mean_us,minflt
+//
+// minflt is the average number of minor page faults per run (from
+// wait4 ()), which drops when text pages are already mapped and shared.
+// There is no peak RSS column: ru_maxrss of a posix_spawn () child
+// starts from this driver's own high-water mark, so it would show the
+// same number for every utility.
+//
+// Utilities, on a 20-line CSV file (cut reads it from STDIN, ls lists
+// its directory):
+//   cat FILE, head -n 1 FILE, cut -d , -f 2, ls DIR, repeat 1 HOME
+
+#define DEFAULT_RUNS 2000
+
+// Variants, by the subdirectory of bindir holding their links; the last
+// one is optional
+static const struct variant
+{
+  const char *name;
+  const char *subdir;
+} variants[] = { { "separate", "" },
+                 { "multicall", "multi/" },
+                 { "static", "multi-static/" } };
+
+#define MAX_VARIANTS (sizeof (variants) / sizeof (variants[0]))
+
+extern char **environ;
+
+typedef struct util
+{
+  const char *name;
+  const char *args[4]; // after the name; "@" stands for the data file
+} util_t;
+
+static util_t utils[] = { { "cat", { "@" } },
+                          { "head", { "-n", "1", "@" } },
+                          { "cut", { "-d", ",", "-f", "2" } },
+                          { "ls", { "@dir" } },
+                          { "repeat", { "1", "HOME" } } };
+
+#define NUM_UTILS (sizeof (utils) / sizeof (utils[0]))
+
+// Results of one variant of one utility
+typedef struct sample
+{
+  double *times; // microseconds
+  long minflt;   // total over the runs
+} sample_t;
+
+static double
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Runs path once with argv and the redirections in actions. Adds its
+   page faults to sample. Returns the time from spawn to
+   reaped child in microseconds, or -1 on failure. */
+static double
+run_once (const char *path, char *argv[],
+          posix_spawn_file_actions_t *actions, sample_t *sample)
+{
+  double start = now_us ();
+  pid_t pid;
+  if (posix_spawn (&pid, path, actions, NULL, argv, environ) != 0)
+    return -1;
+
+  int status;
+  struct rusage usage;
+  if (wait4 (pid, &status, 0, &usage) == -1)
+    return -1;
+  double end = now_us ();
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    return -1;
+
+  sample->minflt += usage.ru_minflt;
+  return end - start;
+}
+
+static void
+report (const char *util, const char *variant, size_t runs,
+        sample_t *sample)
+{
+  double total = 0;
+  for (size_t i = 0; i < runs; i++)
+    total += sample->times[i];
+  qsort (sample->times, runs, sizeof (double), compare);
+  printf ("%s,%s,%zu,%.1f,%.1f,%.1f,%.1f,%.1f\n", util, variant, runs,
+          sample->times[runs / 2], sample->times[(size_t)(runs * 0.90)],
+          sample->times[(size_t)(runs * 0.99)], total / runs,
+          (double)sample->minflt / runs);
+  fflush (stdout);
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr,
+           "Usage: %s [-n runs] [-B bindir] [-u util]\n"
+           "Utilities: cat, head, cut, ls, repeat (default: all)\n"
+           "bindir must hold the utilities and multi/ (make -C ../utils),\n"
+           "and may hold multi-static/ (make -C ../utils static)\n",
+           name);
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t runs = DEFAULT_RUNS;
+  const char *bindir = "../bin";
+  const char *only = NULL;
+  int opt;
+  while ((opt = getopt (argc, argv, "n:B:u:h")) != -1)
+    switch (opt)
+      {
+      case 'n':
+        runs = strtoul (optarg, NULL, 10);
+        break;
+      case 'B':
+        bindir = optarg;
+        break;
+      case 'u':
+        only = optarg;
+        break;
+      default:
+        usage (argv[0]);
+        return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+  if (runs == 0)
+    {
+      usage (argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  char bin[PATH_MAX];
+  if (realpath (bindir, bin) == NULL)
+    {
+      perror (bindir);
+      return EXIT_FAILURE;
+    }
+
+  // A small CSV file is the input of every utility but ls, which lists
+  // the directory holding it
+  char dir[] = "/tmp/dukeutils-bench-XXXXXX";
+  char data[PATH_MAX];
+  if (mkdtemp (dir) == NULL)
+    {
+      perror ("data");
+      return EXIT_FAILURE;
+    }
+  snprintf (data, sizeof (data), "%s/table.csv", dir);
+  FILE *f = fopen (data, "w");
+  if (f == NULL)
+    {
+      perror (data);
+      rmdir (dir);
+      return EXIT_FAILURE;
+    }
+  for (int i = 0; i < 20; i++)
+    fprintf (f, "%d,name%d,%d\n", i, i, i * i);
+  fclose (f);
+
+  int in_fd = open (data, O_RDONLY);
+  int null = open ("/dev/null", O_WRONLY);
+  if (in_fd == -1 || null == -1)
+    {
+      perror ("open");
+      unlink (data);
+      rmdir (dir);
+      return EXIT_FAILURE;
+    }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_adddup2 (&actions, in_fd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2 (&actions, null, STDOUT_FILENO);
+
+  // The static variant only runs when it has been built
+  char probe[PATH_MAX + 32];
+  snprintf (probe, sizeof (probe), "%s/%s", bin,
+            variants[MAX_VARIANTS - 1].subdir);
+  size_t nvariants
+      = (access (probe, X_OK) == 0) ? MAX_VARIANTS : MAX_VARIANTS - 1;
+
+  printf ("util,variant,runs,p50_us,p90_us,p99_us,mean_us,minflt\n");
+  int rc = EXIT_SUCCESS;
+  bool found = false;
+  for (size_t u = 0; u < NUM_UTILS; u++)
+    {
+      util_t *util = &utils[u];
+      if (only != NULL && strcmp (only, util->name))
+        continue;
+      found = true;
+
+      char paths[MAX_VARIANTS][PATH_MAX + 32];
+      for (size_t v = 0; v < nvariants; v++)
+        snprintf (paths[v], sizeof (paths[v]), "%s/%s%s", bin,
+                  variants[v].subdir, util->name);
+
+      char *args[6] = { (char *)util->name };
+      for (int a = 0; a < 4 && util->args[a] != NULL; a++)
+        if (strcmp (util->args[a], "@") == 0)
+          args[a + 1] = data;
+        else if (strcmp (util->args[a], "@dir") == 0)
+          args[a + 1] = dir;
+        else
+          args[a + 1] = (char *)util->args[a];
+
+      // The input is rewound before every run, as cat and friends
+      // share the one descriptor
+      sample_t samples[MAX_VARIANTS];
+      for (size_t v = 0; v < nvariants; v++)
+        {
+          samples[v].times = malloc (runs * sizeof (double));
+          samples[v].minflt = 0;
+        }
+      bool ok = true;
+      for (size_t i = 0; i < runs && ok; i++)
+        for (size_t k = 0; k < nvariants && ok; k++)
+          {
+            size_t v = (i + k) % nvariants;
+            lseek (in_fd, 0, SEEK_SET);
+            double us = run_once (paths[v], args, &actions, &samples[v]);
+            samples[v].times[i] = us;
+            ok = (us >= 0);
+          }
+
+      if (ok)
+        for (size_t v = 0; v < nvariants; v++)
+          report (util->name, variants[v].name, runs, &samples[v]);
+      else
+        {
+          fprintf (stderr, "%s: a run failed\n", util->name);
+          rc = EXIT_FAILURE;
+        }
+      for (size_t v = 0; v < nvariants; v++)
+        free (samples[v].times);
+    }
+
+  posix_spawn_file_actions_destroy (&actions);
+  close (in_fd);
+  close (null);
+  unlink (data);
+  rmdir (dir);
+  if (!found)
+    {
+      usage (argv[0]);
+      return EXIT_FAILURE;
+    }
+  return rc;
+}
@@ -0,0 +1,173 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Bump allocator for the state of a single command line (the FSM, the
+// argument arrays, the pipeline stages, ...). Memory is handed out from
+// a list of chunks and released all at once by arena_reset ().
+//
+// A reset keeps one chunk large enough for everything the line needed,
+// so once the shell has seen a line of a given size, later lines of that
+// size are served without calling malloc at all.
+
+#define CHUNKSIZE 4096
+#define ALIGNMENT (sizeof (align_t))
+
+// Strictest alignment of the types the shell stores
+typedef union align
+{
+  long double ld;
+  long long ll;
+  void *ptr;
+  void (*fn) (void);
+} align_t;
+
+typedef struct chunk
+{
+  struct chunk *next; // previously filled chunk
+  size_t size;        // bytes available in data
+  size_t used;        // bytes handed out from data
+  align_t data[];     // the memory itself
+} chunk_t;
+
+static chunk_t *current = NULL; // chunk being filled
+static size_t line_bytes = 0;   // bytes requested since the last reset
+static size_t line_allocs = 0;  // allocations since the last reset
+static size_t line_chunks = 0;  // chunks malloc'ed since the last reset
+static bool show_stats = false; // print a summary at every reset
+
+static chunk_t *new_chunk (size_t, chunk_t *);
+
+/* Returns size bytes of memory aligned for any type. Aborts if the
+   system runs out of memory. */
+void *
+arena_alloc (size_t size)
+{
+  size_t rounded = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  if (current == NULL || current->size - current->used < rounded)
+    {
+      size_t want = (rounded > CHUNKSIZE) ? rounded : CHUNKSIZE;
+      current = new_chunk (want, current);
+    }
+
+  void *ptr = (char *)current->data + current->used;
+  current->used += rounded;
+  line_bytes += size;
+  line_allocs++;
+  return ptr;
+}
+
+/* Same as calloc (), but from the arena */
+void *
+arena_calloc (size_t nmemb, size_t size)
+{
+  void *ptr = arena_alloc (nmemb * size);
+  memset (ptr, 0, nmemb * size);
+  return ptr;
+}
+
+/* Resizes an arena allocation of oldsize bytes to newsize bytes. The
+   last allocation is extended in place when it fits; otherwise the
+   contents are copied to new memory. */
+void *
+arena_grow (void *ptr, size_t oldsize, size_t newsize)
+{
+  if (ptr == NULL)
+    return arena_alloc (newsize);
+
+  size_t oldround = (oldsize + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  size_t newround = (newsize + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  char *end = (char *)current->data + current->used;
+  if ((char *)ptr + oldround == end
+      && current->size - current->used >= newround - oldround)
+    {
+      current->used += newround - oldround;
+      line_bytes += newsize - oldsize;
+      return ptr;
+    }
+
+  void *copy = arena_alloc (newsize);
+  memcpy (copy, ptr, oldsize);
+  return copy;
+}
+
+/* Same as strdup (), but from the arena */
+char *
+arena_strdup (const char *string)
+{
+  size_t len = strlen (string) + 1;
+  char *copy = arena_alloc (len);
+  memcpy (copy, string, len);
+  return copy;
+}
+
+/* Releases every allocation. If the last line needed more than one
+   chunk, they are replaced by a single chunk of the combined size. */
+void
+arena_reset (void)
+{
+  if (show_stats)
+    fprintf (stderr, "arena: %zu bytes in %zu allocations, %zu new chunks\n",
+             line_bytes, line_allocs, line_chunks);
+  line_bytes = line_allocs = line_chunks = 0;
+
+  if (current == NULL)
+    return;
+
+  if (current->next != NULL)
+    {
+      size_t total = 0;
+      while (current != NULL)
+        {
+          chunk_t *next = current->next;
+          total += current->size;
+          free (current);
+          current = next;
+        }
+      current = new_chunk (total, NULL);
+      line_chunks = 0;
+    }
+  current->used = 0;
+}
+
+/* Frees all of the arena's memory */
+void
+arena_destroy (void)
+{
+  while (current != NULL)
+    {
+      chunk_t *next = current->next;
+      free (current);
+      current = next;
+    }
+}
+
+/* Turns the per-line summary on stderr on or off */
+void
+arena_stats (bool enable)
+{
+  show_stats = enable;
+}
+
+/* **********************************************************************
+ *                Helper functions only below this point                *
+ * ********************************************************************** */
+
+static chunk_t *
+new_chunk (size_t size, chunk_t *next)
+{
+  chunk_t *chunk = malloc (sizeof (chunk_t) + size);
+  if (chunk == NULL)
+    {
+      perror ("arena");
+      abort ();
+    }
+  chunk->next = next;
+  chunk->size = size;
+  chunk->used = 0;
+  line_chunks++;
+  return chunk;
+}
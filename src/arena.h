@@ -0,0 +1,19 @@
+#ifndef __cs361_arena__
+#define __cs361_arena__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Allocations made with these functions live until the next
+// arena_reset (), which the shell calls once per command line. There is
+// no individual free.
+
+void *arena_alloc (size_t);
+void *arena_calloc (size_t, size_t);
+void *arena_grow (void *, size_t, size_t);
+char *arena_strdup (const char *);
+void arena_reset (void);
+void arena_destroy (void);
+void arena_stats (bool);
+
+#endif
@@ -1,152 +1,203 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "builtins.h"
 #include "hash.h"
+#include "jobs.h"
+#include "pathcache.h"
+#include "shell.h"
 
-int
-echo_case (char *message)
+static int benchcmd (int, char *[], int, int);
+static int cd (int, char *[], int, int);
+static int echo (int, char *[], int, int);
+static int export (int, char *[], int, int);
+static int fg (int, char *[], int, int);
+static int hashcmd (int, char *[], int, int);
+static int hashstat (int, char *[], int, int);
+static int jobs (int, char *[], int, int);
+static int pwd (int, char *[], int, int);
+static int quit (int, char *[], int, int);
+static int timecmd (int, char *[], int, int);
+static int unset (int, char *[], int, int);
+static int waitcmd (int, char *[], int, int);
+static int which (int, char *[], int, int);
+static bool write_all (int, const char *, size_t);
+
+// A builtin command: its name and the function that runs it
+typedef struct builtin_entry
 {
-  // check if the message is trying to check the return value
-  if (message[6] == '?')
-    {
-      // find the return value in the global map
-      char *value = hash_find ("?");
-      printf ("%s\n", value);
-      return 0;
-    }
+  const char *name;
+  builtin_fn run;
+} builtin_entry_t;
 
-  // find the starting positions to search for '{' and '}'
-  char *searchStartClose = message + 8;
-  char *searchStartOpen = message + 6;
-  char *found_close = strchr (searchStartClose, '}');
-  char *found_open = strchr (searchStartOpen, '{');
+// The builtins, indexed by builtin_t
+static const builtin_entry_t builtins[NUM_BUILTINS] = {
+  [BUILTIN_QUIT] = { "quit", quit },
+  [BUILTIN_ECHO] = { "echo", echo },
+  [BUILTIN_PWD] = { "pwd", pwd },
+  [BUILTIN_CD] = { "cd", cd },
+  [BUILTIN_WHICH] = { "which", which },
+  [BUILTIN_HASH] = { "hash", hashcmd },
+  [BUILTIN_EXPORT] = { "export", export },
+  [BUILTIN_UNSET] = { "unset", unset },
+  [BUILTIN_JOBS] = { "jobs", jobs },
+  [BUILTIN_WAIT] = { "wait", waitcmd },
+  [BUILTIN_FG] = { "fg", fg },
+  [BUILTIN_TIME] = { "time", timecmd },
+  [BUILTIN_BENCH] = { "bench", benchcmd },
+  [BUILTIN_HASHSTAT] = { "hashstat", hashstat },
+};
 
-  // if both brackets were found, we are checking a variable
-  if (found_close != NULL && found_open != NULL)
-    {
-      // set pointers to the bracket characters
-      char *start = strchr (message, '{');
-      char *end = strchr (message, '}');
-      size_t len = end - start - 1;
-      // allocate a string that will be the variable name
-      char *str = calloc (len + 1, sizeof (char));
-      strncpy (str, start + 1, len);
-      str[len] = '\0';
-      // find the variable by name in the global hash map
-      char *value = hash_find (str);
-      free (str);
-      // print the remainder of the message, switching the variable name with
-      // its value
-      int index = found_open - message;
-      char before[32];
-      strncpy (before, message, index);
-      before[index - 1] = '\0';
-      char result[32];
-      strncpy (result, before + 5, 32);
-      // if the value can be found from the hash map print the whole string
-      if (value != NULL)
-        {
-          printf ("%s%s\n", result, value);
-        }
-      else
-        {
-          // otherwise, just print the string without the variable
-          printf ("%s\n", result);
-        }
-      return 0;
-    }
-  else
+// Key of a name in builtin_lookup (): its length and first character
+#define KEY(len, first) (((len) << 8) | (unsigned char)(first))
+
+// Classifies a command name. Returns the builtin's identifier, or
+// BUILTIN_NONE if name is not a builtin.
+//
+// No two builtins have the same length and first character, so those
+// pick the only candidate and a single comparison confirms it. A new
+// builtin needs a case here as well as an entry in builtins[].
+builtin_t
+builtin_lookup (const char *name)
+{
+  size_t len = strlen (name);
+  builtin_t id;
+  switch (KEY (len, name[0]))
     {
-      // return failure
-      return 1;
+    case KEY (2, 'c'):
+      id = BUILTIN_CD;
+      break;
+    case KEY (2, 'f'):
+      id = BUILTIN_FG;
+      break;
+    case KEY (3, 'p'):
+      id = BUILTIN_PWD;
+      break;
+    case KEY (4, 'e'):
+      id = BUILTIN_ECHO;
+      break;
+    case KEY (4, 'h'):
+      id = BUILTIN_HASH;
+      break;
+    case KEY (4, 'j'):
+      id = BUILTIN_JOBS;
+      break;
+    case KEY (4, 'q'):
+      id = BUILTIN_QUIT;
+      break;
+    case KEY (4, 't'):
+      id = BUILTIN_TIME;
+      break;
+    case KEY (4, 'w'):
+      id = BUILTIN_WAIT;
+      break;
+    case KEY (5, 'b'):
+      id = BUILTIN_BENCH;
+      break;
+    case KEY (5, 'u'):
+      id = BUILTIN_UNSET;
+      break;
+    case KEY (5, 'w'):
+      id = BUILTIN_WHICH;
+      break;
+    case KEY (6, 'e'):
+      id = BUILTIN_EXPORT;
+      break;
+    case KEY (8, 'h'):
+      id = BUILTIN_HASHSTAT;
+      break;
+    default:
+      return BUILTIN_NONE;
     }
+  return (memcmp (name, builtins[id].name, len) == 0) ? id : BUILTIN_NONE;
 }
 
+// Returns the function that runs builtin id
+builtin_fn
+builtin_handler (builtin_t id)
+{
+  return builtins[id].run;
+}
+
+// Runs a builtin (or a utility linked into the shell, see tools.c) with
+// the arguments in argv (NULL-terminated), reading from in_fd and writing
+// to out_fd. Whatever the shell still has buffered on STDOUT is flushed
+// first, so it comes out before the builtin's output.
+//
+// Returns the builtin's return code
 int
-echo_var (char *message)
+builtin_run (builtin_fn run, char *argv[], int in_fd, int out_fd)
 {
-  // make a copy of the message without the beginning "echo" portion
-  char *copy = malloc (strlen (message + 5) + 1);
-  strncpy (copy, message + 5, strlen (message + 5) + 1);
+  int argc = 0;
+  while (argv[argc] != NULL)
+    argc++;
 
-  char *src = copy;
-  char *dst = copy;
-  int in_space = 0;
+  fflush (stdout);
+  int rc = run (argc, argv, in_fd, out_fd);
+  // fg prints the job it resumes with stdio
+  fflush (stdout);
+  return rc;
+}
 
-  while (*src)
-    {
-      // turn areas with more than 1 space into 1 space
-      if (*src == ' ')
-        {
-          if (!in_space)
-            {
-              *dst++ = *src;
-              in_space = 1;
-            }
-        }
-      else
-        {
-          // reset for next encounter of multiple spaces
-          *dst++ = *src;
-          in_space = 0;
-        }
-      src++;
-    }
-  // null terminate the string
-  *dst = '\0';
-  src = copy;
-  dst = copy;
-  while (*src)
-    {
-      // turn areas with a newline string into a literal '\n' character
-      if (src[0] == '\\' && src[1] == 'n')
-        {
-          *dst++ = '\n';
-          src += 2;
-        }
-      else
-        {
-          // otherwise, continue through the string
-          *dst++ = *src++;
-        }
-    }
-  // null terminate the string
-  *dst = '\0';
-  printf ("%s\n", copy);
-  return 0;
+// Leaves the shell. Prints a newline first, so the shell's output ends
+// with one.
+static int
+quit (int argc, char *argv[], int in_fd, int out_fd)
+{
+  write_all (out_fd, "\n", 1);
+  exit (0);
 }
 
-// Given a message as input, print it to the screen followed by a
-// newline ('\n'). If the message contains the two-byte escape sequence
+// Changes the shell's working directory (see chdir()).
+// Returns 0 on success, 1 if there is no argument or the change fails.
+static int
+cd (int argc, char *argv[], int in_fd, int out_fd)
+{
+  if (argc < 2)
+    return 1;
+  return (chdir (argv[1]) == 0) ? 0 : 1;
+}
+
+// Given the arguments of echo (with their variables already expanded,
+// see expand.c), print them separated by single spaces and followed by
+// a newline ('\n'). If an argument contains the two-byte escape sequence
 // "\\n", print a newline '\n' instead. No other escape sequence is
-// allowed. If the sequence contains a '$', it must be an environment
-// variable or the return code variable ("$?"). Environment variable
-// names must be wrapped in curly braces (e.g., ${PATH}).
+// allowed. The line is built in full and written with a single write (),
+// so echo into a pipe costs one system call.
 //
-// Returns 0 for success, 1 for errors (invalid escape sequence or no
-// curly braces around environment variables).
-int
-echo (char *message)
+// Returns 0, or 1 if the output cannot be written.
+static int
+echo (int argc, char *argv[], int in_fd, int out_fd)
 {
-  char *dollar = strchr (message, '$');
-  // check for the '$' character in the string for variable or regular printing
-  if (dollar != NULL)
-    {
-      // regular print case
-      echo_case (message);
-    }
-  else
+  size_t len = 1;
+  for (int i = 1; i < argc; i++)
+    len += strlen (argv[i]) + 1;
+  char *line = arena_alloc (len);
+  char *next = line;
+
+  for (int i = 1; i < argc; i++)
     {
-      // variable case
-      echo_var (message);
+      if (i > 1)
+        *next++ = ' ';
+      for (char *c = argv[i]; *c != '\0'; c++)
+        if (c[0] == '\\' && c[1] == 'n')
+          {
+            *next++ = '\n';
+            c++;
+          }
+        else
+          *next++ = *c;
     }
-  return 0;
+  *next++ = '\n';
+  return write_all (out_fd, line, next - line) ? 0 : 1;
 }
 
 // Given a key-value pair string (e.g., "alpha=beta"), insert the mapping
-// into the global hash table (hash_insert ("alpha", "beta")).
+// into the global hash table (hash_insert (shell_vars, "alpha", "beta")).
 //
 // Returns 0 on success, 1 for an invalid pair string (kvpair is NULL or
 // there is no '=' in the string).
@@ -154,48 +205,68 @@ echo (char *message)
 // NOTE: For some strange reason, clang-format (used for checking the style)
 // expects export to be initially formatted this way...
 
-int export (char *kvpair)
+static int export (int argc, char *argv[], int in_fd, int out_fd)
 {
   // if no arg was passed, terminate
-  if (kvpair == NULL)
+  if (argc < 2)
     {
       return 0;
     }
-  // seperate the key and the value
-  char *key = strtok (kvpair, "=");
-  char *value = strtok (NULL, " ");
-  if (key == NULL || value == NULL)
+  char *kvpair = argv[1];
+  // seperate the key and the value at the first '=' without modifying
+  // kvpair, as bench runs the same arguments several times; everything
+  // after the '=' is the value, spaces included, and it may be empty
+  char *value = strchr (kvpair, '=');
+  if (value == NULL || value == kvpair)
     {
       return 1;
     }
+  char *key = arena_alloc (value - kvpair + 1);
+  memcpy (key, kvpair, value - kvpair);
+  key[value - kvpair] = '\0';
+  value++;
   // inset the values in the global hash map
-  hash_insert (key, value);
+  hash_insert (shell_vars, key, value);
+  // a new PATH invalidates every cached command location
+  if (strcmp (key, "PATH") == 0)
+    path_cache_clear ();
   return 0;
 }
 
 // Prints the current working directory (see getcwd()). Returns 0.
-int
-pwd (void)
+static int
+pwd (int argc, char *argv[], int in_fd, int out_fd)
 {
-  // get the current directory from this c function
-  char *buffer;
-  buffer = getcwd (NULL, 0);
-  printf ("%s\n", buffer);
+  // get the current directory from this c function, growing the buffer
+  // until the path fits
+  size_t size = 256;
+  char *buffer = arena_alloc (size);
+  while (getcwd (buffer, size) == NULL)
+    {
+      if (errno != ERANGE)
+        return 1;
+      size *= 2;
+      buffer = arena_alloc (size);
+    }
+  dprintf (out_fd, "%s\n", buffer);
   return 0;
 }
 
 // Removes a key-value pair from the global hash table.
 // Returns 0 on success, 1 if the key does not exist.
-int
-unset (char *key)
+static int
+unset (int argc, char *argv[], int in_fd, int out_fd)
 {
   // check for invalid arg
-  if (key == NULL)
+  if (argc < 2)
     {
       return 1;
     }
+  char *key = argv[1];
   // remove the given key from the map
-  hash_remove (key);
+  hash_remove (shell_vars, key);
+  if (strcmp (key, "PATH") == 0)
+    path_cache_clear ();
   return 0;
 }
 
@@ -205,18 +276,18 @@ unset (char *key)
 //
 // Returns 0 if at least one location is found, 1 if no commands were
 // passed or no locations found.
-int
-
-which (char *cmdline)
+static int
+which (int argc, char *argv[], int in_fd, int out_fd)
 {
+  if (argc < 2)
+    return 1;
+  char *cmdline = argv[1];
+
   // check what the first argument is
-  if (strcmp (cmdline, "cd") == 0 || strcmp (cmdline, "echo") == 0
-      || strcmp (cmdline, "pwd") == 0 || strcmp (cmdline, "which") == 0
-      || strcmp (cmdline, "export") == 0 || strcmp (cmdline, "unset") == 0
-      || strcmp (cmdline, "quit") == 0)
+  if (builtin_lookup (cmdline) != BUILTIN_NONE)
     {
       // print this message if the given command is builtin
-      printf ("%s: dukesh built-in command\n", cmdline);
+      dprintf (out_fd, "%s: dukesh built-in command\n", cmdline);
       return 0;
     }
 
@@ -225,31 +296,217 @@ which (char *cmdline)
     {
       if (access (cmdline, X_OK) == 0)
         {
-          printf ("%s\n", cmdline);
+          dprintf (out_fd, "%s\n", cmdline);
           return 0;
         }
     }
 
-  // get the current path from the given enviorment variables
-  char *path = getenv ("PATH");
-  char *p = strdup (path);
-  char *dir = strtok (p, ":");
+  // look the command up through the shared command path cache
+  const char *fullpath = path_lookup (cmdline);
+  if (fullpath != NULL)
+    {
+      dprintf (out_fd, "%s\n", fullpath);
+      return 0;
+    }
+  return 1;
+}
+
+// Manages the cache of command locations. With no arguments, list the
+// cached commands and their hit counts. "-r" forgets every location, and
+// any other arguments are looked up in $PATH and added to the cache.
+//
+// Returns 0 on success, 1 if any of the given commands was not found.
+static int
+hashcmd (int argc, char *args[], int in_fd, int out_fd)
+{
+  if (args[1] == NULL)
+    {
+      path_cache_list (out_fd);
+      return 0;
+    }
+
+  int rc = 0;
+  for (int i = 1; args[i] != NULL; i++)
+    {
+      if (strcmp (args[i], "-r") == 0)
+        {
+          path_cache_clear ();
+          continue;
+        }
+      if (!path_cache_add (args[i]))
+        {
+          dprintf (out_fd, "hash: %s: not found\n", args[i]);
+          rc = 1;
+        }
+    }
+  return rc;
+}
+
+// Width of the longest bar in the hashstat histogram
+#define HISTOGRAM_WIDTH 40
 
-  while (dir != NULL)
+// Reports the health of the variable table: size, live entries,
+// tombstones, load factor (counting tombstones, which lengthen probes
+// just like entries), probe lengths in groups of slots, resizes and
+// memory held. "-h" adds a histogram of the probe lengths of the live
+// keys, and "-d" dumps every slot.
+//
+// Returns 0 on success, 1 on an unknown option.
+static int
+hashstat (int argc, char *args[], int in_fd, int out_fd)
+{
+  bool histogram = false;
+  bool dump = false;
+  for (int i = 1; args[i] != NULL; i++)
+    if (strcmp (args[i], "-h") == 0)
+      histogram = true;
+    else if (strcmp (args[i], "-d") == 0)
+      dump = true;
+    else
+      {
+        dprintf (out_fd, "usage: hashstat [-h] [-d]\n");
+        return 1;
+      }
+
+  hash_stats_t stats;
+  hash_stats (shell_vars, &stats);
+  dprintf (out_fd, "capacity    %zu", stats.capacity);
+  if (stats.old_capacity > 0)
+    dprintf (out_fd, " (resizing from %zu)", stats.old_capacity);
+  dprintf (out_fd, "\nentries     %zu\n", stats.entries);
+  dprintf (out_fd, "tombstones  %zu\n", stats.tombstones);
+  dprintf (out_fd, "load        %.1f%%\n", stats.load * 100);
+  dprintf (out_fd,
+           "probe       hit avg %.2f max %zu, miss avg %.2f (groups)\n",
+           stats.hit_probe, stats.max_probe, stats.miss_probe);
+  dprintf (out_fd, "rehashes    %zu\n", stats.rehashes);
+  dprintf (out_fd, "bytes       %zu (pool %zu, %zu garbage)\n", stats.bytes,
+           stats.pool_size, stats.pool_dead);
+  if (stats.shared > 1)
+    dprintf (out_fd, "shared by   %zu\n", stats.shared);
+
+  if (histogram)
     {
-      char fullpath[1024];
-      // print the full path of the executable location
-      snprintf (fullpath, sizeof (fullpath), "%s/%s", dir, cmdline);
-      if (access (fullpath, X_OK) == 0)
+      size_t most = 1;
+      for (int i = 0; i < HASH_PROBE_BUCKETS; i++)
+        if (stats.probes[i] > most)
+          most = stats.probes[i];
+      char bar[HISTOGRAM_WIDTH + 2] = " ";
+      for (int i = 0; i < HASH_PROBE_BUCKETS; i++)
         {
-          printf ("%s\n", fullpath);
-          // free the allocated memory
-          free (p);
-          return 0;
+          size_t width
+              = (stats.probes[i] * HISTOGRAM_WIDTH + most - 1) / most;
+          memset (bar + 1, '#', width);
+          bar[width + 1] = '\0';
+          dprintf (out_fd, "%3d%s %8zu%s\n", i + 1,
+                   (i + 1 == HASH_PROBE_BUCKETS) ? "+" : " ",
+                   stats.probes[i], (width > 0) ? bar : "");
         }
-      dir = strtok (NULL, ":");
     }
 
-  free (p);
+  if (dump)
+    hash_dump (shell_vars, out_fd);
+  return 0;
+}
+
+// Converts a job argument ("2" or "%2") into a job id. With no argument,
+// returns def.
+static int
+job_id (char *arg, int def)
+{
+  if (arg == NULL)
+    return def;
+  if (arg[0] == '%')
+    arg++;
+
+  char *end;
+  long id = strtol (arg, &end, 10);
+  if (*end != '\0' || end == arg || id <= 0)
+    return -1;
+  return (int)id;
+}
+
+// Lists the background jobs and whether they are still running. Returns 0.
+static int
+jobs (int argc, char *argv[], int in_fd, int out_fd)
+{
+  jobs_list (out_fd);
+  return 0;
+}
+
+// Waits for a background job (e.g., "2" or "%2") to finish. With no
+// argument, waits for every background job.
+//
+// Returns the job's return code (0 when waiting for all jobs), or 127 if
+// there is no such job.
+static int
+waitcmd (int argc, char *argv[], int in_fd, int out_fd)
+{
+  char *arg = argv[1];
+  int rc = jobs_wait (job_id (arg, 0), false);
+  if (rc == -1)
+    {
+      dprintf (out_fd, "wait: %s: no such job\n", arg);
+      return 127;
+    }
+  return rc;
+}
+
+// Brings a background job (the most recent one by default) to the
+// foreground by printing its command line and waiting for it.
+//
+// Returns the job's return code, or 1 if there is no such job.
+static int
+fg (int argc, char *argv[], int in_fd, int out_fd)
+{
+  char *arg = argv[1];
+  int rc = jobs_wait (job_id (arg, jobs_last ()), true);
+  if (rc == -1)
+    {
+      dprintf (out_fd, "fg: %s: no such job\n",
+               arg != NULL ? arg : "current");
+      return 1;
+    }
+  return rc;
+}
+
+// A bare time has nothing to measure; time before a command is handled
+// by execute_pipeline (). Returns 0.
+static int
+timecmd (int argc, char *argv[], int in_fd, int out_fd)
+{
+  return 0;
+}
+
+// bench before a command is handled by execute_pipeline (); this only
+// runs when there is no command or the options are malformed. Returns 1.
+static int
+benchcmd (int argc, char *argv[], int in_fd, int out_fd)
+{
+  fprintf (stderr, "usage: bench [-n N] [-w WARMUP] command [args...]\n");
   return 1;
 }
+
+/* **********************************************************************
+ *                Helper functions only below this point                *
+ * ********************************************************************** */
+
+// Writes len bytes to fd, however many write () calls it takes.
+// Returns false on an error, such as a pipe whose reader has exited.
+static bool
+write_all (int fd, const char *data, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t written = write (fd, data, len);
+      if (written == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+      data += written;
+      len -= written;
+    }
+  return true;
+}
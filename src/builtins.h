@@ -3,10 +3,35 @@
 
 #include <stdbool.h>
 
-int echo (char *);
-int export (char *);
-int pwd (void);
-int unset (char *);
-int which (char *);
+// Identifiers of the builtin commands. The numbering is part of the
+// compiled script format (see compile.c); add new builtins at the end.
+typedef enum
+{
+  BUILTIN_NONE = -1, // not a builtin
+  BUILTIN_QUIT,
+  BUILTIN_ECHO,
+  BUILTIN_PWD,
+  BUILTIN_CD,
+  BUILTIN_WHICH,
+  BUILTIN_HASH,
+  BUILTIN_EXPORT,
+  BUILTIN_UNSET,
+  BUILTIN_JOBS,
+  BUILTIN_WAIT,
+  BUILTIN_FG,
+  BUILTIN_TIME,
+  BUILTIN_BENCH,
+  BUILTIN_HASHSTAT,
+  NUM_BUILTINS
+} builtin_t;
+
+// Signature of a builtin's implementation: its arguments (argv[0] is the
+// builtin's name and argv[argc] is NULL), the descriptor to read input
+// from and the one to write output to. Returns the builtin's return code.
+typedef int (*builtin_fn) (int, char *[], int, int);
+
+builtin_fn builtin_handler (builtin_t);
+builtin_t builtin_lookup (const char *);
+int builtin_run (builtin_fn, char *[], int, int);
 
 #endif
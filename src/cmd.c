@@ -8,11 +8,13 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "builtins.h"
 #include "cmd.h"
 #include "hash.h"
+#include "lexer.h"
 #include "process.h"
-
-int fd[2] = { -1, -1 };
+#include "trace.h"
 
 // Integrate the FSM command-line parser from lab 2 here. Note that the FSM
 // effects will be vastly different from that of lab 2. Instead of implementing
@@ -47,7 +49,19 @@ struct fsm
   char *command;       // the name of the command to run
   size_t nargs;        // the number of command-line arguments
   char **args;         // the command-line arguments
+  size_t args_cap;     // allocated length of args
   char *current_token; // current token being processed
+  token_kind_t current_kind; // what kind of token current_token is
+  token_kind_t redirect;     // operator of the redirection being read
+  char *in_file;       // input redirection of the current command
+  char *out_file;      // output redirection of the current command
+  bool append;         // out_file was given with >>
+  stage_t *stages;     // finished stages of the current pipeline
+  size_t nstages;      // number of finished stages
+  size_t stage_cap;    // allocated length of stages
+  pipeline_fn sink;    // receives finished pipelines (NULL: execute them)
+  void *sink_ctx;      // passed through to sink
+  bool failed;         // a syntax error was found
 };
 
 // Generic entry point for handling events
@@ -55,7 +69,8 @@ bool handle_event (fsm_t *, event_t);
 
 // Additional definitions specific to an FSM for command line processing
 
-#define MAX_ARGUMENTS 20
+// Initial length of the args array; it grows as needed
+#define ARGS_INITIAL 8
 
 // Events
 typedef enum
@@ -63,6 +78,9 @@ typedef enum
   TOKEN,   // normal command-line token
   PIPE,    // vertical bar character
   NEWLINE, // newline at the end of the command
+  AMP,     // ampersand (run in the background)
+  SEMI,    // semicolon between pipelines
+  REDIR,   // <, > or >> before a file name
   NIL      // invalid non-event
 } cmdevt_t;
 #define NUM_EVENTS NIL
@@ -74,6 +92,7 @@ typedef enum
   Command,   // establishing the command name
   Arguments, // building the argument list
   Make_Pipe, // linking the commands together for a pipe
+  Redirect,  // expecting the file name of a redirection
   Term,      // terminal state (execute program or error)
   NST        // invalid non-state
 } cmdst_t;
@@ -81,7 +100,7 @@ typedef enum
 
 // Helper functions
 fsm_t *cmdline_init (void); // initialize the FSM
-event_t lookup (char *);    // convert an event string to its numeric value
+event_t lookup (token_kind_t); // convert a token kind to its event
 
 // Translate event/state numbers to their string equivalent
 const char *event_name (event_t);
@@ -92,13 +111,17 @@ start_command (fsm_t *cmdmodel)
 {
   // printf ("Starting new command: %s\n", cmdmodel->current_token);
   // TODO: Copy the current token to store it in the FSM's command
-  // field. Next, create the FSM's args array (length MAX_ARGUMENTS)
+  // field. Next, create the FSM's args array (length ARGS_INITIAL)
   // set the current token as args[0], and initialize nargs to be
   // the number of arguments (1 at this point).
   cmdmodel->command = cmdmodel->current_token;
-  cmdmodel->args = calloc (MAX_ARGUMENTS, sizeof (char *));
+  cmdmodel->args = arena_calloc (ARGS_INITIAL, sizeof (char *));
+  cmdmodel->args_cap = ARGS_INITIAL;
   cmdmodel->args[0] = cmdmodel->current_token;
   cmdmodel->nargs = 1;
+  cmdmodel->in_file = NULL;
+  cmdmodel->out_file = NULL;
+  cmdmodel->append = false;
 }
 
 /* Executed when processing a token after the command name. For instance,
@@ -107,83 +130,161 @@ start_command (fsm_t *cmdmodel)
 void
 append (fsm_t *cmdmodel)
 {
-  if (cmdmodel->nargs >= MAX_ARGUMENTS)
-    return;
-
   // printf ("Appending %s to the argument list\n", cmdmodel->current_token);
   assert (cmdmodel->args != NULL);
 
+  // Keep room for the NULL that terminates the list
+  if (cmdmodel->nargs + 1 == cmdmodel->args_cap)
+    {
+      size_t size = cmdmodel->args_cap * sizeof (char *);
+      cmdmodel->args = arena_grow (cmdmodel->args, size, 2 * size);
+      cmdmodel->args_cap *= 2;
+    }
+
   // TODO: Store the current token into the args array and increment nargs
   cmdmodel->args[cmdmodel->nargs] = cmdmodel->current_token;
   cmdmodel->nargs++;
+  cmdmodel->args[cmdmodel->nargs] = NULL;
+}
+
+/* Executed when <, > or >> follows a command or one of its arguments.
+   The next token is the file name. */
+void
+start_redirect (fsm_t *cmdmodel)
+{
+  cmdmodel->redirect = cmdmodel->current_kind;
+}
+
+/* Executed when processing the file name of a redirection. A later
+   redirection of the same stream replaces an earlier one. */
+void
+set_redirect (fsm_t *cmdmodel)
+{
+  if (cmdmodel->redirect == TOK_IN)
+    cmdmodel->in_file = cmdmodel->current_token;
+  else
+    {
+      cmdmodel->out_file = cmdmodel->current_token;
+      cmdmodel->append = (cmdmodel->redirect == TOK_APPEND);
+    }
 }
 
 /* Executed when either a NL or | (pipe) is encountered. For instance, if
    the command line is "ls -l data NL", the current token will be "NL"; also,
    the FSM's args array should be complete, containing "ls", "-l", and "data",
-   followed by several NULL pointers. */
+   followed by several NULL pointers. The finished command is added to the
+   pipeline as its next stage. */
 void
-execute (fsm_t *cmdmodel)
+end_stage (fsm_t *cmdmodel)
 {
   assert (cmdmodel->args != NULL);
 
-  // TODO: Print out the argument list similar to the format shown and free
-  // the args array.
-  char str[MAX_ARGUMENTS * 10] = "\0";
-  for (int i = 0; i < cmdmodel->nargs; i++)
+  if (cmdmodel->nstages == cmdmodel->stage_cap)
     {
-      char temp[MAX_ARGUMENTS * 10];
-      if (i == 0)
-        {
-          snprintf (temp, sizeof (temp), "%s", cmdmodel->args[i]);
-        }
-      else
-        {
-          snprintf (temp, sizeof (temp), " %s", cmdmodel->args[i]);
-        }
-      strncat (str, temp, sizeof (str) - strlen (str) - 1);
+      size_t size = cmdmodel->stage_cap * sizeof (stage_t);
+      cmdmodel->stage_cap = cmdmodel->stage_cap ? cmdmodel->stage_cap * 2 : 4;
+      cmdmodel->stages = arena_grow (cmdmodel->stages, size,
+                                     cmdmodel->stage_cap * sizeof (stage_t));
     }
-  /*printf ("Execute %s with arguments { %s, (null) }\n", cmdmodel->args[0],
-          str);*/
-  int rc = run_process (str, cmdmodel->args, fd);
-  char rc_str[20];
-  snprintf (rc_str, 20, "%d", rc);
-  hash_insert ("?", rc_str);
-  // printf ("Return code: %d\n", rc);
-  free (cmdmodel->args);
+  stage_t *stage = &cmdmodel->stages[cmdmodel->nstages++];
+  stage->argv = cmdmodel->args;
+  stage->builtin = builtin_lookup (cmdmodel->args[0]);
+  stage->in_file = cmdmodel->in_file;
+  stage->out_file = cmdmodel->out_file;
+  stage->append = cmdmodel->append;
   cmdmodel->args = NULL;
 }
 
-// No changes are needed to the effects below
+/* Drops the stages collected so far, such as after a syntax error. Their
+   memory belongs to the line's arena. */
+static void
+discard_stages (fsm_t *cmdmodel)
+{
+  cmdmodel->nstages = 0;
+}
+
+/* Executed when a NL, ; or & is encountered. Finishes the last stage
+   and runs all the stages as one pipeline, or hands them to the sink when
+   the line is only being parsed. */
+static void
+run_stages (fsm_t *cmdmodel, bool background)
+{
+  end_stage (cmdmodel);
+
+  if (cmdmodel->sink != NULL)
+    cmdmodel->sink (cmdmodel->stages, cmdmodel->nstages, background,
+                    cmdmodel->sink_ctx);
+  else
+    execute_pipeline (cmdmodel->stages, cmdmodel->nstages, background);
+  discard_stages (cmdmodel);
+}
 
 void
-link_commands (fsm_t *cmdmodel)
+execute (fsm_t *cmdmodel)
 {
-  pipe (fd);
-  execute (cmdmodel);
+  run_stages (cmdmodel, false);
+}
+
+/* Executed when a & is encountered. Starts the pipeline as a background
+   job and returns without waiting for it; parsing goes on after the &. */
+void
+execute_background (fsm_t *cmdmodel)
+{
+  run_stages (cmdmodel, true);
+}
+
+// No changes are needed to the effects below
+
+/* Reports a token that is not valid in the current state. Errors are only
+   printed when the line is being executed. */
+static void
+syntax_error (fsm_t *cmdmodel)
+{
+  if (cmdmodel->sink == NULL)
+    printf ("ERROR: Received token %s while in state %s\n",
+            cmdmodel->current_token, state_name (cmdmodel->state));
+  cmdmodel->failed = true;
+  discard_stages (cmdmodel);
 }
 
 void
 error_pipe (fsm_t *cmdmodel)
 {
-  printf ("ERROR: Received token %s while in state %s\n",
-          cmdmodel->current_token, state_name (cmdmodel->state));
+  syntax_error (cmdmodel);
+}
+
+void
+error_background (fsm_t *cmdmodel)
+{
+  syntax_error (cmdmodel);
 }
 
 void
 error_newline (fsm_t *cmdmodel)
 {
-  printf ("ERROR: Received token %s while in state %s\n",
-          cmdmodel->current_token, state_name (cmdmodel->state));
+  syntax_error (cmdmodel);
+}
+
+void
+error_semi (fsm_t *cmdmodel)
+{
+  syntax_error (cmdmodel);
+}
+
+void
+error_redirect (fsm_t *cmdmodel)
+{
+  syntax_error (cmdmodel);
 }
 
 static state_t const _transitions[NUM_STATES][NUM_EVENTS] = {
-  // TOKEN PIPE NEWLINE
-  { Command, Term, NST },         // Init
-  { Arguments, Make_Pipe, Term }, // Command
-  { Arguments, Make_Pipe, Term }, // Arguments
-  { Command, Term, Term },        // Make_Pipe
-  { NST, NST, NST }
+  // TOKEN PIPE NEWLINE AMP SEMI REDIR
+  { Command, Term, Term, Term, Term, Term },                  // Init
+  { Arguments, Make_Pipe, Term, Init, Init, Redirect },       // Command
+  { Arguments, Make_Pipe, Term, Init, Init, Redirect },       // Arguments
+  { Command, Term, Term, Term, Term, Term },                  // Make_Pipe
+  { Arguments, Term, Term, Term, Term, Term },                // Redirect
+  { NST, NST, NST, NST, NST, NST }
 
 };
 
@@ -192,11 +293,17 @@ static state_t const _transitions[NUM_STATES][NUM_EVENTS] = {
 // are function pointers.
 
 static action_t const _effects[NUM_STATES][NUM_EVENTS] = {
-  // TOKEN PIPE NEWLINE
-  { start_command, error_pipe, NULL },         // Init
-  { append, link_commands, execute },          // Command
-  { append, link_commands, execute },          // Arguments
-  { start_command, error_pipe, error_newline } // Make_Pipe
+  // TOKEN PIPE NEWLINE AMP SEMI REDIR
+  { start_command, error_pipe, NULL, error_background, error_semi,
+    error_redirect }, // Init
+  { append, end_stage, execute, execute_background, execute,
+    start_redirect }, // Command
+  { append, end_stage, execute, execute_background, execute,
+    start_redirect }, // Arguments
+  { start_command, error_pipe, error_newline, error_background, error_semi,
+    error_redirect }, // Make_Pipe
+  { set_redirect, error_pipe, error_newline, error_background, error_semi,
+    error_redirect } // Redirect
 
 };
 
@@ -206,17 +313,29 @@ static state_t transition (fsm_t *fsm, event_t event, action_t *effect);
    Some fields are common to most FSMs (such as an initial state or a
    pointer to a transition function). Other fields will be specific to
    this fsm_t declaration. Return NULL if any part of the initialization
-   fails. */
+   fails. The FSM lives in the line's arena. */
 fsm_t *
 cmdline_init (void)
 {
-  fsm_t *fsm = (fsm_t *)calloc (1, sizeof (fsm_t));
+  fsm_t *fsm = (fsm_t *)arena_calloc (1, sizeof (fsm_t));
   fsm->state = Init;
   fsm->transition = transition;
   fsm->command = NULL;
   fsm->nargs = 0;
   fsm->args = NULL;
+  fsm->args_cap = 0;
   fsm->current_token = NULL;
+  fsm->current_kind = TOK_WORD;
+  fsm->redirect = TOK_WORD;
+  fsm->in_file = NULL;
+  fsm->out_file = NULL;
+  fsm->append = false;
+  fsm->stages = NULL;
+  fsm->nstages = 0;
+  fsm->stage_cap = 0;
+  fsm->sink = NULL;
+  fsm->sink_ctx = NULL;
+  fsm->failed = false;
   return fsm;
 }
 
@@ -243,7 +362,8 @@ event_name (event_t evt)
   assert (evt <= NIL);
 
   // Event names for printing out
-  const char *names[] = { "TOKEN", "PIPE", "NEWLINE", "NIL" };
+  const char *names[]
+      = { "TOKEN", "PIPE", "NEWLINE", "AMP", "SEMI", "REDIR", "NIL" };
   return names[evt];
 }
 
@@ -254,8 +374,8 @@ state_name (state_t st)
   assert (st <= NST);
 
   // State names for printing out
-  const char *names[]
-      = { "Init", "Command", "Arguments", "Make_Pipe", "Term", "NST" };
+  const char *names[] = { "Init",     "Command", "Arguments", "Make_Pipe",
+                          "Redirect", "Term",    "NST" };
   return names[st];
 }
 
@@ -295,46 +415,81 @@ handle_event (fsm_t *fsm, event_t event)
   return true;
 }
 
-/* Given a string, return the event type. Do not modify this function. */
+/* Given the kind of a token, return the event type */
 event_t
-lookup (char *token)
+lookup (token_kind_t kind)
 {
-  if (!strcmp (token, "|"))
-    return PIPE;
-
-  if (!strcmp (token, "NL"))
-    return NEWLINE;
-
-  return TOKEN;
+  switch (kind)
+    {
+    case TOK_PIPE:
+      return PIPE;
+    case TOK_AMP:
+      return AMP;
+    case TOK_SEMI:
+      return SEMI;
+    case TOK_IN:
+    case TOK_OUT:
+    case TOK_APPEND:
+      return REDIR;
+    default:
+      return TOKEN;
+    }
 }
 
+/* Parses and executes a command line. Returns the (tokenized) buffer. */
 char *
 parse_buffer (char *buffer)
+{
+  parse_line (buffer, NULL, NULL);
+  return buffer;
+}
+
+/* Parses a command line and passes each pipeline on it to sink, or
+   executes it if sink is NULL. The stages only live until the next
+   arena_reset (). Returns false if the line has a syntax error. */
+bool
+parse_line (char *buffer, pipeline_fn sink, void *ctx)
 {
   fsm_t *cmdmodel = cmdline_init ();
   if (cmdmodel == NULL)
-    return NULL;
-
-  // TODO: Change this to split the string into tokens, where
-  // each token is an event that needs to be handled. After
-  // looking up the event number, store the token in the FSM
-  // and call handle_event().
-  char *input = buffer;
-  char *token = strtok (input, " ");
-  while (token != NULL)
+    return false;
+  cmdmodel->sink = sink;
+  cmdmodel->sink_ctx = ctx;
+
+  // The whole line is split first (see lexer.c) and then fed to the FSM,
+  // so the two phases can be traced separately. A line with an unclosed
+  // quote is not run at all.
+  double start = trace_now ();
+  token_t *tokens;
+  size_t ntokens;
+  bool lexed = lex_line (buffer, &tokens, &ntokens);
+  trace_span ("tokenize", "parse", start, NULL);
+  if (!lexed)
+    {
+      if (sink == NULL)
+        printf ("ERROR: Unterminated quote\n");
+      return false;
+    }
+
+  start = trace_now ();
+  bool running = true;
+  for (size_t i = 0; i < ntokens && running; i++)
+    {
+      cmdmodel->current_token = tokens[i].text;
+      cmdmodel->current_kind = tokens[i].kind;
+      running = handle_event (cmdmodel, lookup (tokens[i].kind));
+    }
+
+  // The end of the buffer is the newline that runs the pipeline
+  if (running)
     {
-      cmdmodel->current_token = token;
-      event_t event = lookup (token);
-      bool running = handle_event (cmdmodel, event);
-      if (!running)
-        break;
-      token = strtok (NULL, " ");
+      cmdmodel->current_token = "NL";
+      cmdmodel->current_kind = TOK_WORD;
+      handle_event (cmdmodel, NEWLINE);
     }
-  execute (cmdmodel);
+  trace_span ("fsm", "parse", start, NULL);
 
-  // Free remaining allocated data
-  if (cmdmodel->args != NULL)
-    free (cmdmodel->args);
-  free (cmdmodel);
-  return input;
+  // Everything allocated for this line is released by the caller's
+  // arena_reset ()
+  return !cmdmodel->failed;
 }
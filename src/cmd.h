@@ -1,6 +1,16 @@
 #ifndef __cs361_cmd_h__
 #define __cs361_cmd_h__
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "process.h"
+
+// Receives the stages of each pipeline found by parse_line (), and
+// whether the pipeline runs in the background
+typedef void (*pipeline_fn) (stage_t *, size_t, bool, void *);
+
 char *parse_buffer (char *buffer);
+bool parse_line (char *, pipeline_fn, void *);
 
 #endif
@@ -0,0 +1,567 @@
+// realpath ()
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "builtins.h"
+#include "cmd.h"
+#include "compile.h"
+#include "jobs.h"
+#include "pathcache.h"
+#include "process.h"
+#include "trace.h"
+
+// Compiled scripts. A -b script is parsed once into a compact
+// representation (the pipelines of every line, with pre-split argument
+// lists and pre-classified builtins) that is cached on disk. Later runs
+// of an unchanged script map the cache and execute from it directly,
+// without tokenizing or driving the FSM again.
+//
+// The cache is stored next to the script as ".NAME.dkc", or in
+// $DUKESH_CACHE_DIR if that is set. It is keyed by the script's path,
+// size and mtime, and by the size and mtime of the shell binary itself,
+// so a rebuilt shell whose representation changed without a VERSION bump
+// does not run a stale cache. A cache that does not match is simply
+// rebuilt.
+//
+// Anyone who can write to the script's directory can plant a cache, so
+// one is only used if it belongs to the user running the shell and
+// nobody else can write to it, and every count and offset in it is
+// checked against its bounds before any line runs. A cache that fails a
+// check is rebuilt like a stale one. The cache is written to a new file
+// made by mkstemp () and renamed into place.
+//
+// File layout (native byte order, the cache is not portable):
+//
+//   header    script_header_t
+//   path      the script's real path, padded to 4 bytes
+//   code      uint32_t words, one record per line:
+//               text offset, text length, kind, number of pipelines,
+//               then for each pipeline:
+//                 background flag, number of stages,
+//                 then for each stage:
+//                   builtin, argc, argc offsets,
+//                   input file offset, output file offset, append flag
+//                   (NO_FILE for a missing redirection)
+//   strings   NUL-terminated strings; offsets are relative to here
+//
+// Lines with a syntax error are stored as LINE_RAW and re-parsed at run
+// time, so the error is reported exactly as an uncompiled run would.
+
+#define MAGIC "DKSC"
+#define VERSION 3
+
+#define NO_FILE UINT32_MAX
+
+enum
+{
+  LINE_COMPILED, // pipelines follow
+  LINE_RAW       // parse the text at run time
+};
+
+typedef struct script_header
+{
+  char magic[4];         // MAGIC
+  uint32_t version;      // VERSION
+  uint32_t nbuiltins;    // NUM_BUILTINS when compiled
+  uint32_t nlines;       // number of line records
+  uint64_t src_size;     // size of the script
+  int64_t src_sec;       // mtime of the script
+  int64_t src_nsec;      //   (nanoseconds)
+  uint64_t exe_size;     // size of the shell binary
+  int64_t exe_sec;       // mtime of the shell binary
+  int64_t exe_nsec;      //   (nanoseconds)
+  uint32_t path_len;     // length of the path, without padding
+  uint32_t code_words;   // number of words in code
+  uint64_t strings_len;  // bytes in strings
+} script_header_t;
+
+// Growable buffers the representation is built in
+typedef struct program
+{
+  uint32_t *code;
+  size_t ncode;
+  size_t code_cap;
+  char *strings;
+  size_t nstrings;
+  size_t strings_cap;
+  uint32_t nlines;
+  size_t npipelines_at; // code index of the current line's count
+} program_t;
+
+static char *cache_path (const char *);
+static void emit (program_t *, uint32_t);
+static uint32_t emit_string (program_t *, const char *, size_t);
+static void emit_pipeline (stage_t *, size_t, bool, void *);
+static bool check_code (const uint32_t *, uint32_t, uint32_t, const char *,
+                        uint64_t);
+static void execute_code (const uint32_t *, uint32_t, char *);
+static bool load_script (const char *, program_t *, struct stat *);
+static void shell_identity (script_header_t *);
+static bool write_cache (const char *, const char *, program_t *,
+                         struct stat *);
+
+/* Compiles a script and writes its cache, without running it. Returns
+   false if the script cannot be read or the cache cannot be written. */
+bool
+compile_script (const char *path)
+{
+  program_t prog;
+  struct stat st;
+  if (!load_script (path, &prog, &st))
+    return false;
+
+  char *cache = cache_path (path);
+  bool ok = (cache != NULL) && write_cache (cache, path, &prog, &st);
+  if (!ok)
+    fprintf (stderr, "%s: cannot write compiled script\n", path);
+
+  free (cache);
+  free (prog.code);
+  free (prog.strings);
+  return ok;
+}
+
+/* Runs a script from its cache, compiling it (and refreshing the cache)
+   first if the cache is missing or stale. Returns false if the script
+   cannot be read. */
+bool
+run_compiled (const char *path)
+{
+  double start = trace_now ();
+  struct stat st;
+  if (stat (path, &st) == -1)
+    {
+      perror (path);
+      return false;
+    }
+
+  char *cache = cache_path (path);
+  char real[PATH_MAX];
+  int fd = -1;
+  if (cache != NULL && realpath (path, real) != NULL)
+    fd = open (cache, O_RDONLY | O_NOFOLLOW);
+
+  struct stat cst;
+  if (fd != -1 && fstat (fd, &cst) == 0 && S_ISREG (cst.st_mode)
+      && cst.st_uid == geteuid ()
+      && (cst.st_mode & (S_IWGRP | S_IWOTH)) == 0
+      && (size_t)cst.st_size >= sizeof (script_header_t))
+    {
+      size_t length = (size_t)cst.st_size;
+      // Private and writable: builtins may modify their arguments
+      char *map = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                        fd, 0);
+      close (fd);
+      fd = -1;
+      if (map == MAP_FAILED)
+        map = NULL;
+
+      script_header_t *hdr = (script_header_t *)map;
+      script_header_t self;
+      shell_identity (&self);
+      size_t path_words = map ? (hdr->path_len + 3) / 4 : 0;
+      if (map != NULL && !memcmp (hdr->magic, MAGIC, 4)
+          && hdr->version == VERSION && hdr->nbuiltins == NUM_BUILTINS
+          && hdr->exe_size == self.exe_size && hdr->exe_sec == self.exe_sec
+          && hdr->exe_nsec == self.exe_nsec
+          && hdr->src_size == (uint64_t)st.st_size
+          && hdr->src_sec == (int64_t)st.st_mtim.tv_sec
+          && hdr->src_nsec == (int64_t)st.st_mtim.tv_nsec
+          && hdr->strings_len <= length
+          && length
+                 == sizeof (script_header_t) + path_words * 4
+                        + (size_t)hdr->code_words * 4 + hdr->strings_len
+          && hdr->path_len == strlen (real)
+          && !memcmp (map + sizeof (script_header_t), real, hdr->path_len)
+          && check_code ((uint32_t *)(map + sizeof (script_header_t)
+                                      + path_words * 4),
+                         hdr->code_words, hdr->nlines,
+                         map + length - hdr->strings_len, hdr->strings_len))
+        {
+          uint32_t *code = (uint32_t *)(map + sizeof (script_header_t)
+                                        + path_words * 4);
+          trace_span ("read", "input", start, cache);
+          execute_code (code, hdr->nlines, (char *)(code + hdr->code_words));
+          munmap (map, length);
+          free (cache);
+          return true;
+        }
+      if (map != NULL)
+        munmap (map, length);
+    }
+  if (fd != -1)
+    close (fd);
+
+  // No usable cache: compile now, save it for next time and run it
+  program_t prog;
+  if (!load_script (path, &prog, &st))
+    {
+      free (cache);
+      return false;
+    }
+  if (cache != NULL)
+    write_cache (cache, path, &prog, &st);
+  execute_code (prog.code, prog.nlines, prog.strings);
+
+  free (cache);
+  free (prog.code);
+  free (prog.strings);
+  return true;
+}
+
+/* **********************************************************************
+ *                Helper functions only below this point                *
+ * ********************************************************************** */
+
+/* Builds the name of the cache file for a script. Returns NULL if the
+   script's real path cannot be determined. The result must be freed. */
+static char *
+cache_path (const char *path)
+{
+  char real[PATH_MAX];
+  if (realpath (path, real) == NULL)
+    return NULL;
+
+  char *dir = getenv ("DUKESH_CACHE_DIR");
+  char *cache = malloc (strlen (real) + (dir ? strlen (dir) : 0) + 32);
+  if (dir != NULL)
+    {
+      // One file per script, named after a hash of its real path
+      unsigned long hash = 5381;
+      for (unsigned char *ptr = (unsigned char *)real; *ptr != '\0'; ptr++)
+        hash = ((hash << 5) + hash) + *ptr;
+      sprintf (cache, "%s/%016lx.dkc", dir, hash);
+      return cache;
+    }
+
+  // Hidden file in the script's own directory
+  char *slash = strrchr (real, '/');
+  *slash = '\0';
+  sprintf (cache, "%s/.%s.dkc", real, slash + 1);
+  return cache;
+}
+
+static void
+emit (program_t *prog, uint32_t word)
+{
+  if (prog->ncode == prog->code_cap)
+    {
+      prog->code_cap *= 2;
+      prog->code = realloc (prog->code, prog->code_cap * sizeof (uint32_t));
+    }
+  prog->code[prog->ncode++] = word;
+}
+
+/* Appends a string (and a NUL) to the string section. Returns its
+   offset. */
+static uint32_t
+emit_string (program_t *prog, const char *string, size_t len)
+{
+  while (prog->nstrings + len + 1 > prog->strings_cap)
+    {
+      prog->strings_cap *= 2;
+      prog->strings = realloc (prog->strings, prog->strings_cap);
+    }
+  uint32_t offset = (uint32_t)prog->nstrings;
+  memcpy (prog->strings + offset, string, len);
+  prog->strings[offset + len] = '\0';
+  prog->nstrings += len + 1;
+  return offset;
+}
+
+/* parse_line () sink that records a pipeline instead of running it */
+static void
+emit_pipeline (stage_t *stages, size_t nstages, bool background, void *ctx)
+{
+  program_t *prog = ctx;
+  prog->code[prog->npipelines_at]++;
+  emit (prog, background ? 1 : 0);
+  emit (prog, (uint32_t)nstages);
+  for (size_t i = 0; i < nstages; i++)
+    {
+      size_t argc = 0;
+      while (stages[i].argv[argc] != NULL)
+        argc++;
+
+      emit (prog, (uint32_t)stages[i].builtin);
+      emit (prog, (uint32_t)argc);
+      for (size_t a = 0; a < argc; a++)
+        emit (prog, emit_string (prog, stages[i].argv[a],
+                                 strlen (stages[i].argv[a])));
+
+      char *files[] = { stages[i].in_file, stages[i].out_file };
+      for (int f = 0; f < 2; f++)
+        emit (prog, (files[f] != NULL)
+                        ? emit_string (prog, files[f], strlen (files[f]))
+                        : NO_FILE);
+      emit (prog, stages[i].append ? 1 : 0);
+    }
+}
+
+/* Checks that the nlines line records in the words of code only refer
+   to strings inside the strings_len bytes at strings, and that they fill
+   code exactly, so that execute_code () never reads outside the cache.
+   Returns false at the first violation. */
+static bool
+check_code (const uint32_t *code, uint32_t words, uint32_t nlines,
+            const char *strings, uint64_t strings_len)
+{
+  // Every string ends inside the section if its last byte is a NUL
+  if (strings_len > 0 && strings[strings_len - 1] != '\0')
+    return false;
+
+  size_t at = 0;
+  for (uint32_t line = 0; line < nlines; line++)
+    {
+      if (words - at < 4 || code[at] >= strings_len
+          || code[at + 1] > strings_len - code[at] || code[at + 2] > LINE_RAW)
+        return false;
+      uint32_t npipelines = code[at + 3];
+      at += 4;
+
+      for (uint32_t p = 0; p < npipelines; p++)
+        {
+          if (words - at < 2 || code[at + 1] == 0)
+            return false;
+          uint32_t nstages = code[at + 1];
+          at += 2;
+
+          for (uint32_t i = 0; i < nstages; i++)
+            {
+              if (words - at < 2)
+                return false;
+              int32_t builtin = (int32_t)code[at];
+              uint32_t argc = code[at + 1];
+              if (builtin < BUILTIN_NONE || builtin >= NUM_BUILTINS
+                  || argc == 0 || words - at - 2 < argc
+                  || words - at - 2 - argc < 3)
+                return false;
+              for (uint32_t a = 0; a < argc; a++)
+                if (code[at + 2 + a] >= strings_len)
+                  return false;
+              at += 2 + argc;
+
+              // Redirections, then the append flag
+              for (int f = 0; f < 2; f++)
+                if (code[at + f] != NO_FILE && code[at + f] >= strings_len)
+                  return false;
+              if (code[at + 2] > 1)
+                return false;
+              at += 3;
+            }
+        }
+    }
+  return at == words;
+}
+
+/* Runs the line records of a compiled script. Argument lists point
+   straight into strings; only the pointer arrays are built per line. */
+static void
+execute_code (const uint32_t *code, uint32_t nlines, char *strings)
+{
+  for (uint32_t line = 0; line < nlines; line++)
+    {
+      // Report background jobs that finished since the last command
+      jobs_notify ();
+
+      char *text = strings + code[0];
+      uint32_t len = code[1];
+      uint32_t kind = code[2];
+      uint32_t npipelines = code[3];
+      code += 4;
+      printf ("$ %.*s\n", (int)len, text);
+      double start = trace_now ();
+      path_cache_tick ();
+
+      if (kind == LINE_RAW)
+        parse_buffer (arena_strdup (text));
+
+      for (uint32_t p = 0; p < npipelines; p++)
+        {
+          bool background = code[0] != 0;
+          uint32_t nstages = code[1];
+          code += 2;
+
+          stage_t *stages = arena_alloc (nstages * sizeof (stage_t));
+          for (uint32_t i = 0; i < nstages; i++)
+            {
+              uint32_t argc = code[1];
+              stages[i].builtin = (builtin_t)(int32_t)code[0];
+              stages[i].argv = arena_alloc ((argc + 1) * sizeof (char *));
+              for (uint32_t a = 0; a < argc; a++)
+                stages[i].argv[a] = strings + code[2 + a];
+              stages[i].argv[argc] = NULL;
+              code += 2 + argc;
+
+              stages[i].in_file
+                  = (code[0] != NO_FILE) ? strings + code[0] : NULL;
+              stages[i].out_file
+                  = (code[1] != NO_FILE) ? strings + code[1] : NULL;
+              stages[i].append = code[2] != 0;
+              code += 3;
+            }
+          execute_pipeline (stages, nstages, background);
+        }
+      trace_span ("line", "shell", start, text);
+      arena_reset ();
+    }
+}
+
+/* Reads and compiles a script. Fills prog (whose buffers must be freed)
+   and the script's stat information. Returns false if the script cannot
+   be read. */
+static bool
+load_script (const char *path, program_t *prog, struct stat *st)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd == -1 || fstat (fd, st) == -1)
+    {
+      perror (path);
+      if (fd != -1)
+        close (fd);
+      return false;
+    }
+
+  size_t length = (size_t)st->st_size;
+  char *data = NULL;
+  if (length > 0)
+    {
+      data = mmap (NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED)
+        {
+          perror (path);
+          close (fd);
+          return false;
+        }
+    }
+  close (fd);
+
+  memset (prog, 0, sizeof (program_t));
+  prog->code_cap = 1024;
+  prog->code = malloc (prog->code_cap * sizeof (uint32_t));
+  prog->strings_cap = length + 1024;
+  prog->strings = malloc (prog->strings_cap);
+
+  char *end = data + length;
+  for (char *line = data; line != NULL && line < end;)
+    {
+      char *nl = memchr (line, '\n', end - line);
+      size_t len = (nl != NULL) ? (size_t)(nl - line) : (size_t)(end - line);
+
+      emit (prog, emit_string (prog, line, len));
+      emit (prog, (uint32_t)len);
+      size_t kind_at = prog->ncode;
+      emit (prog, LINE_COMPILED);
+      prog->npipelines_at = prog->ncode;
+      emit (prog, 0);
+
+      // Tokenizing modifies the line, so parse a copy
+      char *copy = arena_alloc (len + 1);
+      memcpy (copy, line, len);
+      copy[len] = '\0';
+      if (!parse_line (copy, emit_pipeline, prog))
+        {
+          // Drop the pipelines recorded before the error
+          prog->ncode = prog->npipelines_at + 1;
+          prog->code[kind_at] = LINE_RAW;
+          prog->code[prog->npipelines_at] = 0;
+        }
+      arena_reset ();
+
+      prog->nlines++;
+      line = (nl != NULL) ? nl + 1 : NULL;
+    }
+
+  if (data != NULL)
+    munmap (data, length);
+  return true;
+}
+
+/* Records the size and mtime of the running shell binary in hdr. They
+   stay 0 where /proc/self/exe is not available. */
+static void
+shell_identity (script_header_t *hdr)
+{
+  struct stat st;
+  hdr->exe_size = 0;
+  hdr->exe_sec = 0;
+  hdr->exe_nsec = 0;
+  if (stat ("/proc/self/exe", &st) == 0)
+    {
+      hdr->exe_size = (uint64_t)st.st_size;
+      hdr->exe_sec = (int64_t)st.st_mtim.tv_sec;
+      hdr->exe_nsec = (int64_t)st.st_mtim.tv_nsec;
+    }
+}
+
+/* Writes a compiled script to its cache file. The file is written under
+   a fresh temporary name and renamed, so readers never see a partial
+   cache and a planted file or link is never written through. */
+static bool
+write_cache (const char *cache, const char *path, program_t *prog,
+             struct stat *st)
+{
+  char real[PATH_MAX];
+  if (realpath (path, real) == NULL)
+    return false;
+
+  script_header_t hdr;
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, MAGIC, 4);
+  hdr.version = VERSION;
+  hdr.nbuiltins = NUM_BUILTINS;
+  hdr.nlines = prog->nlines;
+  hdr.src_size = (uint64_t)st->st_size;
+  hdr.src_sec = (int64_t)st->st_mtim.tv_sec;
+  hdr.src_nsec = (int64_t)st->st_mtim.tv_nsec;
+  shell_identity (&hdr);
+  hdr.path_len = (uint32_t)strlen (real);
+  hdr.code_words = (uint32_t)prog->ncode;
+  hdr.strings_len = prog->nstrings;
+
+  char *tmp = malloc (strlen (cache) + 8);
+  sprintf (tmp, "%s.XXXXXX", cache);
+  int fd = mkstemp (tmp);
+  FILE *out = (fd != -1) ? fdopen (fd, "w") : NULL;
+  if (out == NULL)
+    {
+      if (fd != -1)
+        {
+          close (fd);
+          unlink (tmp);
+        }
+      free (tmp);
+      return false;
+    }
+
+  char pad[4] = { 0, 0, 0, 0 };
+  size_t path_words = (hdr.path_len + 3) / 4;
+  bool ok = fwrite (&hdr, sizeof (hdr), 1, out) == 1
+            && fwrite (real, 1, hdr.path_len, out) == hdr.path_len
+            && fwrite (pad, 1, path_words * 4 - hdr.path_len, out)
+                   == path_words * 4 - hdr.path_len
+            && fwrite (prog->code, sizeof (uint32_t), prog->ncode, out)
+                   == prog->ncode
+            && fwrite (prog->strings, 1, prog->nstrings, out)
+                   == prog->nstrings;
+  if (fclose (out) != 0)
+    ok = false;
+
+  if (ok)
+    ok = rename (tmp, cache) == 0;
+  if (!ok)
+    unlink (tmp);
+  free (tmp);
+  return ok;
+}
@@ -0,0 +1,9 @@
+#ifndef __cs361_compile__
+#define __cs361_compile__
+
+#include <stdbool.h>
+
+bool compile_script (const char *);
+bool run_compiled (const char *);
+
+#endif
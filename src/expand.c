@@ -0,0 +1,179 @@
+#include <string.h>
+
+#include "arena.h"
+#include "builtins.h"
+#include "expand.h"
+#include "hash.h"
+#include "lexer.h"
+#include "process.h"
+#include "shell.h"
+
+// Variable expansion. Every stage of a pipeline goes through here right
+// before it runs (in execute_pipeline (), so compiled scripts see the
+// current values too). Three forms of reference are replaced by the
+// variable's value, as many times as they appear in a word:
+//
+//   $?        the return code of the last pipeline
+//   ${NAME}   any variable
+//   $NAME     a variable whose name is letters, digits and underscores
+//
+// An unset variable expands to nothing, and the word is kept even if it
+// ends up empty. There is no word splitting. A $ not followed by one of
+// these forms is left alone, and so is one that was quoted with '' or
+// escaped (the lexer stores it as LITERAL_DOLLAR).
+//
+// A word without any $ is used as it is, without being copied. Expanded
+// words are built in the line's arena, in a buffer that grows as needed,
+// and each reference is looked up in the variable table once.
+
+// Names up to this length are looked up from a buffer on the stack
+#define NAME_INLINE 64
+
+// A word being built in the arena
+typedef struct buffer
+{
+  char *data;
+  size_t len;
+  size_t cap;
+} buffer_t;
+
+static void append (buffer_t *, const char *, size_t);
+static const char *lookup_name (const char *, size_t);
+static size_t name_length (const char *);
+
+/* Returns word with its variable references replaced by their values.
+   If there is nothing to replace, word itself is returned; otherwise the
+   result lives in the line's arena. */
+char *
+expand_word (char *word)
+{
+  static const char specials[] = { '$', LITERAL_DOLLAR, '\0' };
+  char *first = strpbrk (word, specials);
+  if (first == NULL)
+    return word;
+
+  size_t len = strlen (word);
+  buffer_t out = { NULL, 0, 0 };
+  out.cap = len + 1;
+  out.data = arena_alloc (out.cap);
+  append (&out, word, first - word);
+
+  const char *next = first;
+  while (*next != '\0')
+    {
+      if (*next == LITERAL_DOLLAR)
+        {
+          append (&out, "$", 1);
+          next++;
+          continue;
+        }
+      if (*next != '$')
+        {
+          size_t plain = strcspn (next, specials);
+          append (&out, next, plain);
+          next += plain;
+          continue;
+        }
+
+      // next is a $; find the name it refers to, if any
+      const char *name = next + 1;
+      size_t namelen;
+      const char *after;
+      const char *close;
+      if (name[0] == '?')
+        {
+          namelen = 1;
+          after = name + 1;
+        }
+      else if (name[0] == '{' && (close = strchr (name, '}')) != NULL)
+        {
+          name++;
+          namelen = close - name;
+          after = close + 1;
+        }
+      else if ((namelen = name_length (name)) > 0)
+        after = name + namelen;
+      else
+        {
+          append (&out, "$", 1);
+          next++;
+          continue;
+        }
+
+      const char *value = lookup_name (name, namelen);
+      if (value != NULL)
+        append (&out, value, strlen (value));
+      next = after;
+    }
+
+  out.data[out.len] = '\0';
+  return out.data;
+}
+
+/* Expands the arguments and redirections of each stage. A stage whose
+   command name changed is classified again, so "$CMD" can name a
+   builtin. */
+void
+expand_stages (stage_t *stages, size_t nstages)
+{
+  for (size_t i = 0; i < nstages; i++)
+    {
+      stage_t *stage = &stages[i];
+      char *command = stage->argv[0];
+      for (size_t a = 0; stage->argv[a] != NULL; a++)
+        stage->argv[a] = expand_word (stage->argv[a]);
+      if (stage->argv[0] != command)
+        stage->builtin = builtin_lookup (stage->argv[0]);
+
+      if (stage->in_file != NULL)
+        stage->in_file = expand_word (stage->in_file);
+      if (stage->out_file != NULL)
+        stage->out_file = expand_word (stage->out_file);
+    }
+}
+
+/* **********************************************************************
+ *                Helper functions only below this point                *
+ * ********************************************************************** */
+
+/* Adds len bytes to the end of a buffer, doubling it if they (and the
+   final NUL) do not fit */
+static void
+append (buffer_t *buffer, const char *bytes, size_t len)
+{
+  if (buffer->len + len + 1 > buffer->cap)
+    {
+      size_t cap = buffer->cap;
+      while (buffer->len + len + 1 > cap)
+        cap *= 2;
+      buffer->data = arena_grow (buffer->data, buffer->cap, cap);
+      buffer->cap = cap;
+    }
+  memcpy (buffer->data + buffer->len, bytes, len);
+  buffer->len += len;
+}
+
+/* Looks up the variable whose name is the first len bytes of name.
+   Returns its value, or NULL if it is not set. */
+static const char *
+lookup_name (const char *name, size_t len)
+{
+  char inline_name[NAME_INLINE];
+  char *key = (len < NAME_INLINE) ? inline_name : arena_alloc (len + 1);
+  memcpy (key, name, len);
+  key[len] = '\0';
+  return hash_find (shell_vars, key);
+}
+
+/* Length of the variable name at the start of string: a letter or an
+   underscore followed by letters, digits and underscores */
+static size_t
+name_length (const char *string)
+{
+  static const char first[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                              "abcdefghijklmnopqrstuvwxyz_";
+  if (string[0] == '\0' || strchr (first, string[0]) == NULL)
+    return 0;
+  return 1 + strspn (string + 1, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                 "abcdefghijklmnopqrstuvwxyz0123456789_");
+}
@@ -0,0 +1,11 @@
+#ifndef __cs361_expand__
+#define __cs361_expand__
+
+#include <stddef.h>
+
+#include "process.h"
+
+char *expand_word (char *);
+void expand_stages (stage_t *, size_t);
+
+#endif
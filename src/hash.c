@@ -1,284 +1,792 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "hash.h"
 
-static ssize_t find_index (char *);
-static unsigned long hash (unsigned char *);
-static bool insert_help (char *, char *, bool);
-static void rehash (size_t);
+// Open addressing in the style of Swiss tables. Besides the slots, the
+// table keeps one control byte per slot: EMPTY, DELETED, or the low 7
+// bits of the key's hash (its tag) for a full slot. Slots are probed in
+// groups of 16 control bytes, compared against the tag all at once (with
+// SSE2 when available), so strcmp only runs on slots whose tag matches.
+// Each slot caches the key's full hash, so rehashing never recomputes it.
+//
+// Resizing is incremental. When the table has to grow or shrink, a new
+// table is allocated and the old one is kept; every insert and remove
+// then moves at most MIGRATE_GROUPS groups of the old table into the new
+// one. Lookups check both tables until the old one is empty and freed.
+// No single operation walks the whole table to resize it.
+//
+// Keys and values are not malloc'ed one by one. A string of up to
+// INLINE_MAX bytes (exit codes, most names) is stored in the slot itself;
+// longer ones go into a single pool buffer and are referred to by their
+// offset. Overwriting a value with one that fits in its space reuses it,
+// so "?" changing after every command costs no allocation at all. Space
+// freed in the pool is reclaimed by compacting it once more than half of
+// it is garbage, which walks the table but is paid for by the updates
+// that produced the garbage.
+//
+// Pointers returned by hash_find () and hash_keys () point into the slots
+// or the pool, so they are only valid until the next insert or remove.
+//
+// All of that state lives in a store_t. A hash_t is a handle on a store,
+// and hash_clone () makes another handle on the same store, so cloning is
+// O(1). The first change made through a handle whose store is shared
+// gives the handle a private copy of the store (copy-on-write).
+
+#define INLINE_MAX 16 // bytes, including the NUL
+
+// Where a key or a value is stored; see kvpair_t.pooled for which member
+typedef union strref
+{
+  char small[INLINE_MAX]; // the string itself
+  struct
+  {
+    size_t offset; // start in the pool
+    size_t size;   // bytes reserved there
+  } pooled;
+} strref_t;
 
-#define MINSIZE 100
-#define PRIME 97
+#define KEY_POOLED 1
+#define VALUE_POOLED 2
 
 typedef struct kvpair
 {
-  char *key;
-  char *value;
-  bool alive;
+  uint64_t hash; // full hash of key
+  strref_t key;
+  strref_t value;
+  uint8_t pooled; // KEY_POOLED and VALUE_POOLED bits
 } kvpair_t;
 
-static kvpair_t *table = NULL;
-static size_t capacity = 0;
-static size_t entries = 0;
+typedef struct table
+{
+  kvpair_t *slots;
+  uint8_t *ctrl;     // one control byte per slot
+  size_t capacity;   // number of slots, a power of 2 >= GROUP (0 if none)
+  size_t used;       // live entries
+  size_t tombstones; // DELETED control bytes
+} table_t;
+
+typedef struct store
+{
+  table_t current;          // receives new entries
+  table_t old;              // being migrated (capacity 0 if not resizing)
+  size_t migrated;          // old groups already moved
+  unsigned long generation; // changes on every update
+  size_t refs;              // handles sharing this store
+  size_t rehashes;          // resizes started (for hash_stats)
+
+  char *pool;       // storage for long keys and values
+  size_t pool_size; // bytes allocated
+  size_t pool_used; // bytes handed out (including garbage)
+  size_t pool_dead; // bytes handed out and released since
+} store_t;
+
+struct hash
+{
+  store_t *store;
+};
+
+static uint64_t hash (const char *);
+static void alloc_table (table_t *, size_t);
+static void compact_pool (store_t *);
+static void copy_table (table_t *, const table_t *);
+static void free_store (store_t *);
+static void free_table (table_t *);
+static size_t find_slot (store_t *, table_t *, const char *, uint64_t);
+static size_t find_free (table_t *, uint64_t);
+static bool lookup (store_t *, const char *, uint64_t, table_t **, size_t *);
+static void migrate (store_t *, size_t);
+static size_t pool_alloc (store_t *, size_t);
+static size_t probe_length (const table_t *, size_t);
+static void put (table_t *, const kvpair_t *);
+static void release_string (store_t *, kvpair_t *, uint8_t);
+static void remove_slot (store_t *, table_t *, size_t);
+static void set_string (store_t *, kvpair_t *, uint8_t, const char *);
+static void start_resize (store_t *, size_t);
+static store_t *writable (hash_t *);
 
-void
-hash_destroy (void)
+#define MINSIZE 100
+#define GROUP 16
+
+// Pool sizes: initial buffer, and garbage below which it is not compacted
+#define POOL_INITIAL 4096
+#define POOL_SLACK 4096
+
+// Groups of the old table moved per insert or remove while resizing.
+// Growing from C slots (at C/2 entries) to 2C leaves room for C/2 more
+// inserts before the next resize, but the C/GROUP old groups are moved
+// within C/(GROUP * MIGRATE_GROUPS) operations, so a migration always
+// ends long before another one is needed.
+#define MIGRATE_GROUPS 2
+
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+#define NOT_FOUND ((size_t)-1)
+
+// Last generation handed out. Generations are unique across stores, so
+// a handle that switches to a private copy never reports an old one.
+static unsigned long generations = 0;
+
+/* Bit mask of the positions in a group whose control byte equals byte */
+static inline unsigned
+group_match (const uint8_t *group, uint8_t byte)
 {
-  if (table == NULL)
-    return;
+#ifdef __SSE2__
+  __m128i ctrls = _mm_loadu_si128 ((const __m128i *)group);
+  return (unsigned)_mm_movemask_epi8 (
+      _mm_cmpeq_epi8 (ctrls, _mm_set1_epi8 ((char)byte)));
+#else
+  unsigned mask = 0;
+  for (unsigned i = 0; i < GROUP; i++)
+    if (group[i] == byte)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
 
-  for (size_t i = 0; i < capacity; i++)
-    {
-      if (table[i].key != NULL)
-        {
-          free (table[i].key);
-          table[i].key = NULL;
-        }
-      if (table[i].value != NULL)
-        {
-          free (table[i].value);
-          table[i].value = NULL;
-        }
-    }
-  free (table);
+/* Bit mask of the positions in a group that are EMPTY or DELETED (both
+   have the high bit set, full slots never do) */
+static inline unsigned
+group_free (const uint8_t *group)
+{
+#ifdef __SSE2__
+  return (unsigned)_mm_movemask_epi8 (
+      _mm_loadu_si128 ((const __m128i *)group));
+#else
+  unsigned mask = 0;
+  for (unsigned i = 0; i < GROUP; i++)
+    if (group[i] & 0x80)
+      mask |= 1u << i;
+  return mask;
+#endif
 }
 
-/* Dumps the table contents to STDOUT (useful for debugging) */
-void
-hash_dump (void)
+/* Index of the lowest set bit of a non-zero mask */
+static inline unsigned
+lowest_bit (unsigned mask)
 {
-  printf ("TABLE:\n");
-  for (size_t i = 0; i < capacity; i++)
-    if (table[i].key != NULL)
-      printf ("  [%zd].%s = %s%s\n", i, table[i].key, table[i].value,
-              (!table[i].alive ? " [deleted]" : ""));
+  return (unsigned)__builtin_ctz (mask);
 }
 
-/* Initializes the hash table to a given size (minimum 100) */
-void
-hash_init (size_t size)
+/* The key or value (which is KEY_POOLED or VALUE_POOLED) of a slot */
+static inline char *
+get_string (store_t *st, kvpair_t *slot, uint8_t which)
 {
-  if (table != NULL)
-    free (table);
+  strref_t *ref = (which == KEY_POOLED) ? &slot->key : &slot->value;
+  if (slot->pooled & which)
+    return st->pool + ref->pooled.offset;
+  return ref->small;
+}
 
-  // Minimum of 100 entries to start
-  if (size < MINSIZE)
-    size = MINSIZE;
+/* Makes a new handle on the same contents as table. Nothing is copied
+   until one of the two is changed. */
+hash_t *
+hash_clone (hash_t *table)
+{
+  hash_t *clone = malloc (sizeof (hash_t));
+  clone->store = table->store;
+  clone->store->refs++;
+  return clone;
+}
 
-  table = calloc (size, sizeof (kvpair_t));
-  capacity = size;
-  entries = 0;
+/* Dumps the table contents to fd (useful for debugging) */
+void
+hash_dump (hash_t *handle, int fd)
+{
+  store_t *st = handle->store;
+  table_t *tables[] = { &st->old, &st->current };
+  for (int t = 0; t < 2; t++)
+    {
+      table_t *table = tables[t];
+      if (table->capacity == 0)
+        continue;
+      dprintf (fd, "%s:\n", (table == &st->old) ? "OLD TABLE" : "TABLE");
+      for (size_t i = 0; i < table->capacity; i++)
+        if (table->ctrl[i] == CTRL_DELETED)
+          dprintf (fd, "  [%zd] [deleted]\n", i);
+        else if (table->ctrl[i] != CTRL_EMPTY)
+          dprintf (fd, "  [%zd].%s = %s (tag %02x)\n", i,
+                   get_string (st, &table->slots[i], KEY_POOLED),
+                   get_string (st, &table->slots[i], VALUE_POOLED),
+                   table->ctrl[i]);
+    }
+  dprintf (fd, "POOL: %zu of %zu bytes used, %zu garbage\n", st->pool_used,
+           st->pool_size, st->pool_dead);
+  dprintf (fd, "SHARED BY: %zu\n", st->refs);
 }
 
 /* Find the value for a given key. Returns NULL if there is no entry for
    the given key. */
 char *
-hash_find (char *key)
+hash_find (hash_t *handle, char *key)
 {
-  if (table == NULL) // uninitialized table
-    return NULL;
-
-  ssize_t index = find_index (key);
-  assert (index >= 0);
-
-  if (table[index].key == NULL) // key not found
+  store_t *st = handle->store;
+  table_t *table;
+  size_t index;
+  if (!lookup (st, key, hash (key), &table, &index)) // key not found
     return NULL;
+  return get_string (st, &table->slots[index], VALUE_POOLED);
+}
 
-  // If .key is not NULL, find_index found a key match
-  assert (!strcmp (table[index].key, key));
-  if (table[index].alive) // not marked for deletion
-    return table[index].value;
+/* Releases a handle, and its contents unless another handle shares
+   them. */
+void
+hash_free (hash_t *handle)
+{
+  if (handle == NULL)
+    return;
+  if (--handle->store->refs == 0)
+    free_store (handle->store);
+  free (handle);
+}
 
-  return NULL;
+/* Returns a counter that changes whenever an entry is added, removed or
+   given a different value. Used to tell if derived data (such as the
+   environment passed to children) is stale. Clones share the generation
+   of their original until either one changes. */
+unsigned long
+hash_generation (hash_t *handle)
+{
+  return handle->store->generation;
 }
 
 /* Inserts a new entry into the hash table. If there is already an entry
-   for the given key, replace the value (freeing the old one). */
+   for the given key, replace the value (reusing its storage if the new
+   one fits). Storing the value a key already has is a no-op. */
 bool
-hash_insert (char *key, char *value)
+hash_insert (hash_t *handle, char *key, char *value)
 {
-  if (table == NULL) // uninitialized table
-    return false;
+  uint64_t keyhash = hash (key);
+  table_t *table;
+  size_t index;
+  if (lookup (handle->store, key, keyhash, &table, &index)
+      && !strcmp (get_string (handle->store, &table->slots[index],
+                              VALUE_POOLED),
+                  value))
+    return true;
+
+  store_t *st = writable (handle);
+  st->generation = ++generations;
+  migrate (st, MIGRATE_GROUPS);
 
-  return insert_help (key, value, true);
+  if (lookup (st, key, keyhash, &table, &index))
+    {
+      set_string (st, &table->slots[index], VALUE_POOLED, value);
+      compact_pool (st);
+      return true;
+    }
+
+  // New entry for this key. Keep live entries plus tombstones at or
+  // below half the table: grow if the entries alone would pass that,
+  // otherwise move everything to a fresh table of the same size.
+  table_t *current = &st->current;
+  size_t entries = current->used + st->old.used + 1;
+  if (entries + current->tombstones > current->capacity / 2)
+    start_resize (st, (entries > current->capacity / 2)
+                          ? current->capacity * 2
+                          : current->capacity);
+
+  kvpair_t entry = { .hash = keyhash, .pooled = 0 };
+  set_string (st, &entry, KEY_POOLED, key);
+  set_string (st, &entry, VALUE_POOLED, value);
+  put (&st->current, &entry);
+  return true;
 }
 
 /* Gets a list of pointers to the keys in the hash table. */
 char **
-hash_keys (void)
+hash_keys (hash_t *handle)
 {
-  if (table == NULL) // uninitialized table
-    return NULL;
-
-  char **keys = calloc (entries + 1, sizeof (char *));
+  store_t *st = handle->store;
+  char **keys = calloc (st->current.used + st->old.used + 1, sizeof (char *));
   size_t next = 0;
-  for (size_t i = 0; i < capacity; i++)
-    if (table[i].key != NULL && table[i].alive)
-      keys[next++] = table[i].key;
+  table_t *tables[] = { &st->old, &st->current };
+  for (int t = 0; t < 2; t++)
+    for (size_t i = 0; i < tables[t]->capacity; i++)
+      if (!(tables[t]->ctrl[i] & 0x80))
+        keys[next++] = get_string (st, &tables[t]->slots[i], KEY_POOLED);
   return keys;
 }
 
-/* Removes a key-value pair from the hash table. Marks the entry as
-   deleted. Can be overwritten later. */
-bool
-hash_remove (char *key)
+/* Creates an empty table with room for size entries (minimum 100,
+   rounded up to a power of 2) */
+hash_t *
+hash_new (size_t size)
 {
-  if (table == NULL) // uninitialized table
-    return false;
+  // Minimum of 100 entries to start
+  if (size < MINSIZE)
+    size = MINSIZE;
+
+  size_t capacity = GROUP;
+  while (capacity < size)
+    capacity *= 2;
 
-  ssize_t index = find_index (key);
-  assert (index >= 0);
+  store_t *st = calloc (1, sizeof (store_t));
+  alloc_table (&st->current, capacity);
+  st->generation = ++generations;
+  st->refs = 1;
 
-  if (table[index].key == NULL) // key not found
+  hash_t *handle = malloc (sizeof (hash_t));
+  handle->store = st;
+  return handle;
+}
+
+/* Removes a key-value pair from the hash table. The table shrinks to
+   half its size once it is less than 1/8 full, which leaves it 1/4 full:
+   far enough from both thresholds that alternating inserts and removes
+   cannot make it resize back and forth. */
+bool
+hash_remove (hash_t *handle, char *key)
+{
+  uint64_t keyhash = hash (key);
+  table_t *table;
+  size_t index;
+  if (!lookup (handle->store, key, keyhash, &table, &index)) // not found
     return true;
 
-  // If .key is not NULL, find_index found a key match
-  assert (!strcmp (table[index].key, key));
-  table[index].alive = false;
-  entries--;
+  store_t *st = writable (handle);
+  st->generation = ++generations;
+  migrate (st, MIGRATE_GROUPS);
+
+  // Migrating (or copying the store) may have moved the entry
+  if (lookup (st, key, keyhash, &table, &index))
+    remove_slot (st, table, index);
+  compact_pool (st);
 
-  if ((entries < capacity / 4) && (capacity / 2 >= MINSIZE))
-    rehash (capacity / 2);
+  table_t *current = &st->current;
+  if (st->old.capacity == 0 && current->used < current->capacity / 8
+      && current->capacity / 2 >= MINSIZE)
+    start_resize (st, current->capacity / 2);
 
   return true;
 }
 
+/* Fills in stats with the size and health of the table. Walks every
+   slot, so it is meant for diagnostics rather than regular use. */
+void
+hash_stats (hash_t *handle, hash_stats_t *stats)
+{
+  store_t *st = handle->store;
+  memset (stats, 0, sizeof (hash_stats_t));
+  stats->capacity = st->current.capacity;
+  stats->old_capacity = st->old.capacity;
+  stats->rehashes = st->rehashes;
+  stats->pool_size = st->pool_size;
+  stats->pool_dead = st->pool_dead;
+  stats->shared = st->refs;
+  stats->bytes = sizeof (store_t) + st->pool_size;
+
+  size_t total = 0;
+  table_t *tables[] = { &st->old, &st->current };
+  for (int t = 0; t < 2; t++)
+    {
+      table_t *table = tables[t];
+      stats->entries += table->used;
+      stats->tombstones += table->tombstones;
+      stats->bytes += table->capacity * (sizeof (kvpair_t) + 1);
+      for (size_t i = 0; i < table->capacity; i++)
+        {
+          if (table->ctrl[i] & 0x80)
+            continue;
+          size_t length = probe_length (table, i);
+          total += length;
+          if (length > stats->max_probe)
+            stats->max_probe = length;
+          stats->probes[(length < HASH_PROBE_BUCKETS)
+                            ? length - 1
+                            : HASH_PROBE_BUCKETS - 1]++;
+        }
+    }
+  if (stats->entries > 0)
+    stats->hit_probe = (double)total / stats->entries;
+
+  // A miss ends at the first group with an EMPTY slot, so average that
+  // distance over every group a key can hash to
+  table_t *current = &st->current;
+  size_t groups = current->capacity / GROUP;
+  total = 0;
+  for (size_t home = 0; home < groups; home++)
+    {
+      size_t g = home;
+      size_t step = 1;
+      while (step < groups
+             && group_match (current->ctrl + g * GROUP, CTRL_EMPTY) == 0)
+        g = (g + step++) & (groups - 1);
+      total += step;
+    }
+  if (groups > 0)
+    {
+      stats->miss_probe = (double)total / groups;
+      stats->load = (double)(current->used + current->tombstones)
+                    / current->capacity;
+    }
+}
+
 /* **********************************************************************
  *                Helper functions only below this point                *
  * ********************************************************************** */
 
-static bool
-insert_help (char *key, char *value, bool dup)
+/* Allocates an empty table. Only the control bytes are initialized (a
+   slot is read only when its control byte says it is full), so the
+   cost of a new table is one byte per slot. */
+static void
+alloc_table (table_t *table, size_t capacity)
 {
-  ssize_t index = find_index (key);
-  assert (index >= 0); // failed to find an open slot; should never happen
+  table->slots = malloc (capacity * sizeof (kvpair_t));
+  table->ctrl = malloc (capacity);
+  memset (table->ctrl, CTRL_EMPTY, capacity);
+  table->capacity = capacity;
+  table->used = 0;
+  table->tombstones = 0;
+}
 
-  if (table[index].key == NULL)
-    {
-      // New entry for this key. Check if rehashing is needed.
-      if (entries + 1 > capacity / 2)
-        {
-          rehash (capacity * 2);
-          index = find_index (key);
-        }
+/* Moves the live strings of the pool to the front of a new buffer, once
+   more than half of it is garbage. The work is proportional to the
+   garbage that built up since the last compaction. */
+static void
+compact_pool (store_t *st)
+{
+  if (st->pool_dead < POOL_SLACK || st->pool_dead < st->pool_used / 2)
+    return;
 
-      // Set the entries in the table (duplicating if requested)
-      if (dup)
-        {
-          table[index].key = strdup (key);
-          table[index].value = strdup (value);
-        }
-      else
+  size_t live = st->pool_used - st->pool_dead;
+  size_t size = POOL_INITIAL;
+  while (size < 2 * live)
+    size *= 2;
+  char *fresh = malloc (size);
+  size_t used = 0;
+
+  table_t *tables[] = { &st->old, &st->current };
+  for (int t = 0; t < 2; t++)
+    for (size_t i = 0; i < tables[t]->capacity; i++)
+      {
+        kvpair_t *slot = &tables[t]->slots[i];
+        if ((tables[t]->ctrl[i] & 0x80) || slot->pooled == 0)
+          continue;
+        strref_t *refs[] = { &slot->key, &slot->value };
+        for (int r = 0; r < 2; r++)
+          if (slot->pooled & (r == 0 ? KEY_POOLED : VALUE_POOLED))
+            {
+              memcpy (fresh + used, st->pool + refs[r]->pooled.offset,
+                      refs[r]->pooled.size);
+              refs[r]->pooled.offset = used;
+              used += refs[r]->pooled.size;
+            }
+      }
+
+  free (st->pool);
+  st->pool = fresh;
+  st->pool_size = size;
+  st->pool_used = used;
+  st->pool_dead = 0;
+}
+
+/* Makes dst (unallocated) a copy of src, with the same layout */
+static void
+copy_table (table_t *dst, const table_t *src)
+{
+  *dst = *src;
+  if (src->capacity == 0)
+    return;
+
+  dst->slots = malloc (src->capacity * sizeof (kvpair_t));
+  dst->ctrl = malloc (src->capacity);
+  memcpy (dst->ctrl, src->ctrl, src->capacity);
+  for (size_t i = 0; i < src->capacity; i++)
+    if (!(src->ctrl[i] & 0x80))
+      dst->slots[i] = src->slots[i];
+}
+
+static void
+free_store (store_t *st)
+{
+  free_table (&st->current);
+  free_table (&st->old);
+  free (st->pool);
+  free (st);
+}
+
+/* Frees a table; its strings belong to the pool or to the slots */
+static void
+free_table (table_t *table)
+{
+  free (table->slots);
+  free (table->ctrl);
+  table->slots = NULL;
+  table->ctrl = NULL;
+  table->capacity = table->used = table->tombstones = 0;
+}
+
+/* Returns the slot holding key, or NOT_FOUND. Groups are visited in
+   triangular order (g, g+1, g+3, g+6, ...), which reaches every group of
+   a power-of-2 table; the search ends at the first group with an EMPTY
+   slot. */
+static size_t
+find_slot (store_t *st, table_t *table, const char *key, uint64_t keyhash)
+{
+  size_t groups = table->capacity / GROUP;
+  size_t g = (size_t)(keyhash >> 7) & (groups - 1);
+  uint8_t tag = keyhash & 0x7F;
+
+  for (size_t step = 1; step <= groups; step++)
+    {
+      const uint8_t *group = table->ctrl + g * GROUP;
+      for (unsigned mask = group_match (group, tag); mask != 0;
+           mask &= mask - 1)
         {
-          table[index].key = key;
-          table[index].value = value;
+          kvpair_t *slot = &table->slots[g * GROUP + lowest_bit (mask)];
+          if (slot->hash == keyhash
+              && !strcmp (get_string (st, slot, KEY_POOLED), key))
+            return slot - table->slots;
         }
-      entries++;
-      table[index].alive = true;
-
-      return true;
+      if (group_match (group, CTRL_EMPTY) != 0)
+        return NOT_FOUND;
+      g = (g + step) & (groups - 1);
     }
+  return NOT_FOUND;
+}
 
-  // If table[index].key is not NULL, it must match the existing key OR
-  // the existing entry has been deleted. Otherwise, the double hashing
-  // should have found a different location. If the key does not match
-  // the current key, replace it.
-  if (strcmp (table[index].key, key))
+/* Returns the first EMPTY or DELETED slot on key's probe sequence */
+static size_t
+find_free (table_t *table, uint64_t keyhash)
+{
+  size_t groups = table->capacity / GROUP;
+  size_t g = (size_t)(keyhash >> 7) & (groups - 1);
+
+  for (size_t step = 1; step <= groups; step++)
     {
-      assert (!table[index].alive);
-      free (table[index].key);
-      if (dup)
-        table[index].key = strdup (key);
-      else
-        table[index].key = key;
+      unsigned mask = group_free (table->ctrl + g * GROUP);
+      if (mask != 0)
+        return g * GROUP + lowest_bit (mask);
+      g = (g + step) & (groups - 1);
     }
 
-  // Free the old value and replace it
-  free (table[index].value);
-  if (dup)
-    table[index].value = strdup (value);
-  else
-    table[index].value = value;
-  table[index].alive = true;
+  // Due to rehashing, there should always be at least 50% of the table
+  // entries free. So there should always be a free space.
+  abort ();
+}
 
-  return true;
+/* djb2 by Dan Bernstein, finished with a multiplicative mix so that the
+   tag (low 7 bits) and the group index (high bits) both vary */
+static uint64_t
+hash (const char *string)
+{
+  uint64_t hash = 5381;
+
+  // hash = hash * 33 + ch
+  for (const unsigned char *ptr = (const unsigned char *)string;
+       *ptr != '\0'; ptr++)
+    hash = ((hash << 5) + hash) + *ptr;
+
+  hash *= 0x9E3779B97F4A7C15ull;
+  return hash ^ (hash >> 32);
 }
 
-static ssize_t
-find_index (char *str)
+/* Looks for key in the current table, then in the one being migrated.
+   On success, stores where it was found. */
+static bool
+lookup (store_t *st, const char *key, uint64_t keyhash, table_t **table,
+        size_t *index)
 {
-  if (table == NULL)
-    return -1;
+  *table = &st->current;
+  if ((*index = find_slot (st, *table, key, keyhash)) != NOT_FOUND)
+    return true;
 
-  unsigned long keyhash = hash ((unsigned char *)str);
-  // probe is 1 .. PRIME, guaranteed non-zero
-  unsigned long probe = PRIME - (keyhash % PRIME);
+  *table = &st->old;
+  return st->old.used > 0
+         && (*index = find_slot (st, *table, key, keyhash)) != NOT_FOUND;
+}
+
+/* Moves up to the given number of groups from the old table into the
+   current one. The old table is freed once it holds no entries. */
+static void
+migrate (store_t *st, size_t groups)
+{
+  table_t *old = &st->old;
+  if (old->capacity == 0)
+    return;
 
-  // Use double hashing to resolve collisions
-  size_t index = (size_t)(keyhash % capacity);
-  ssize_t first_open = -1;
-  for (size_t i = 0; i < capacity; i++)
+  size_t end = old->capacity / GROUP;
+  while (groups-- > 0 && st->migrated < end && old->used > 0)
     {
-      size_t trial = (index + (size_t)(i * probe)) % capacity;
-      // If the key is NULL, we have not encountered the string. If there
-      // was an earlier open spot, use that one. Otherwise, use the spot
-      // with the empty key.
-      if (table[trial].key == NULL)
+      size_t base = st->migrated++ * GROUP;
+      for (unsigned mask = ~group_free (old->ctrl + base) & 0xFFFF;
+           mask != 0; mask &= mask - 1)
         {
-          if (first_open < 0)
-            return (ssize_t)trial;
-          else
-            return first_open;
+          kvpair_t *slot = &old->slots[base + lowest_bit (mask)];
+          put (&st->current, slot);
+          // Lookups in the old table must still probe past this slot
+          old->ctrl[slot - old->slots] = CTRL_DELETED;
+          old->used--;
         }
+    }
 
-      // Keep track of the first open index. This will be returned if
-      // the key has not been previously entered and deleted.
-      if (first_open < 0 && !table[trial].alive)
-        first_open = trial;
+  if (old->used == 0)
+    {
+      free_table (old);
+      st->migrated = 0;
+    }
+}
 
-      // If the key has been previously used, re-use this position
-      if (!strcmp (table[trial].key, str))
-        return (ssize_t)trial;
+/* Reserves size bytes at the end of the pool and returns their offset.
+   The pool may move, so this must not be called while holding a pointer
+   into it. */
+static size_t
+pool_alloc (store_t *st, size_t size)
+{
+  if (st->pool_size - st->pool_used < size)
+    {
+      if (st->pool_size == 0)
+        st->pool_size = POOL_INITIAL;
+      while (st->pool_size - st->pool_used < size)
+        st->pool_size *= 2;
+      st->pool = realloc (st->pool, st->pool_size);
     }
 
-  // Due to rehashing, there should always be at least 50% of the table
-  // entries free. So there should always be a free space.
-  abort ();
+  size_t offset = st->pool_used;
+  st->pool_used += size;
+  return offset;
 }
 
-static unsigned long
-hash (unsigned char *string)
+/* Number of groups visited to reach the full slot index on its key's
+   probe sequence (1 if it is in its home group) */
+static size_t
+probe_length (const table_t *table, size_t index)
 {
-  if (string == NULL)
-    return 0;
+  size_t groups = table->capacity / GROUP;
+  size_t g = (size_t)(table->slots[index].hash >> 7) & (groups - 1);
+  size_t step = 1;
+  while (g != index / GROUP && step < groups)
+    g = (g + step++) & (groups - 1);
+  return step;
+}
 
-  unsigned long hash = 5381;
+/* Stores an entry (whose key is known to be absent) in the first free
+   slot, taking over its strings */
+static void
+put (table_t *table, const kvpair_t *entry)
+{
+  size_t index = find_free (table, entry->hash);
+  if (table->ctrl[index] == CTRL_DELETED)
+    table->tombstones--;
+  table->ctrl[index] = entry->hash & 0x7F;
+  table->slots[index] = *entry;
+  table->used++;
+}
 
-  // Derived from djb2 by Dan Bernstein
-  // hash = hash * 33 + ch
-  for (unsigned char *ptr = string; *ptr != '\0'; ptr++)
-    hash = ((hash << 5) + hash) + *ptr;
+/* Gives the pool space of a slot's key or value back, if it has any */
+static void
+release_string (store_t *st, kvpair_t *slot, uint8_t which)
+{
+  if (!(slot->pooled & which))
+    return;
+  strref_t *ref = (which == KEY_POOLED) ? &slot->key : &slot->value;
+  st->pool_dead += ref->pooled.size;
+  slot->pooled &= ~which;
+}
+
+/* Frees the entry in a slot. The slot becomes a tombstone unless no
+   probe sequence can have passed through it. */
+static void
+remove_slot (store_t *st, table_t *table, size_t index)
+{
+  release_string (st, &table->slots[index], KEY_POOLED);
+  release_string (st, &table->slots[index], VALUE_POOLED);
+
+  // A group that still has an EMPTY slot has never been full, so no
+  // lookup ever probed past it and the slot can simply become EMPTY
+  const uint8_t *group = table->ctrl + (index & ~(size_t)(GROUP - 1));
+  if (group_match (group, CTRL_EMPTY) != 0)
+    table->ctrl[index] = CTRL_EMPTY;
+  else
+    {
+      table->ctrl[index] = CTRL_DELETED;
+      table->tombstones++;
+    }
+  table->used--;
 
-  return hash;
+  if (table == &st->old && table->used == 0)
+    {
+      free_table (table);
+      st->migrated = 0;
+    }
 }
 
+/* Sets the key or value (which is KEY_POOLED or VALUE_POOLED) of a slot.
+   The string goes in the slot if it fits, in its current pool space if
+   it fits there, and in new pool space (rounded up to 8 bytes) if not. */
 static void
-rehash (size_t newcap)
+set_string (store_t *st, kvpair_t *slot, uint8_t which, const char *string)
 {
-  size_t oldcap = capacity;
-  capacity = newcap;
-  kvpair_t *oldtable = table;
-  table = calloc (capacity, sizeof (kvpair_t));
-  entries = 0;
+  strref_t *ref = (which == KEY_POOLED) ? &slot->key : &slot->value;
+  size_t len = strlen (string) + 1;
+
+  if (len <= INLINE_MAX)
+    {
+      release_string (st, slot, which);
+      memcpy (ref->small, string, len);
+      return;
+    }
 
-  for (int i = 0; i < oldcap; i++)
+  if ((slot->pooled & which) && len <= ref->pooled.size)
     {
-      if (oldtable[i].key != NULL && oldtable[i].alive)
-        insert_help (oldtable[i].key, oldtable[i].value, false);
+      memcpy (st->pool + ref->pooled.offset, string, len);
+      return;
     }
+
+  release_string (st, slot, which);
+  size_t size = (len + 7) & ~(size_t)7;
+  ref->pooled.offset = pool_alloc (st, size);
+  ref->pooled.size = size;
+  memcpy (st->pool + ref->pooled.offset, string, len);
+  slot->pooled |= which;
+}
+
+/* Starts moving the entries into a new table of newcap slots. A
+   migration still in progress is finished first (see MIGRATE_GROUPS for
+   why that is rare). */
+static void
+start_resize (store_t *st, size_t newcap)
+{
+  if (st->old.capacity != 0)
+    migrate (st, SIZE_MAX);
+
+  st->old = st->current;
+  alloc_table (&st->current, newcap);
+  st->rehashes++;
+  st->migrated = 0;
+  migrate (st, MIGRATE_GROUPS);
+}
+
+/* Returns the store of a handle, first giving the handle its own copy
+   if other handles share it. A copy keeps the layout of both tables (and
+   so any migration in progress); the pool is copied as it is. */
+static store_t *
+writable (hash_t *handle)
+{
+  store_t *shared = handle->store;
+  if (shared->refs == 1)
+    return shared;
+
+  store_t *st = malloc (sizeof (store_t));
+  *st = *shared;
+  copy_table (&st->current, &shared->current);
+  copy_table (&st->old, &shared->old);
+  st->pool = malloc (shared->pool_size);
+  if (shared->pool_used > 0)
+    memcpy (st->pool, shared->pool, shared->pool_used);
+  st->refs = 1;
+
+  shared->refs--;
+  handle->store = st;
+  return st;
 }
@@ -2,14 +2,44 @@
 #define __cs361_hash__
 
 #include <stdbool.h>
+#include <stddef.h>
 
-void hash_dump (void); // for debugging if needed
+typedef struct hash hash_t;
 
-void hash_destroy (void);
-void hash_init (size_t);
-char *hash_find (char *);
-bool hash_insert (char *, char *);
-char **hash_keys (void);
-bool hash_remove (char *);
+// Probe lengths counted separately by hash_stats (); longer probes are
+// counted in the last bucket
+#define HASH_PROBE_BUCKETS 8
+
+// Health of a table, filled in by hash_stats (). Probe lengths are in
+// groups of slots visited, so a key found in its home group has length 1.
+typedef struct hash_stats
+{
+  size_t capacity;      // slots in the current table
+  size_t old_capacity;  // slots in the table being migrated (0 if none)
+  size_t entries;       // live keys
+  size_t tombstones;    // deleted slots that still lengthen probes
+  double load;          // (entries + tombstones) / capacity
+  double hit_probe;     // average probe length of the live keys
+  size_t max_probe;     // longest probe length of a live key
+  double miss_probe;    // average probe length of a missing key
+  size_t rehashes;      // resizes (including same-size rebuilds) so far
+  size_t bytes;         // memory held: tables, pool and bookkeeping
+  size_t pool_size;     // bytes allocated for long strings
+  size_t pool_dead;     // of which garbage waiting for compaction
+  size_t shared;        // handles sharing these contents
+  size_t probes[HASH_PROBE_BUCKETS]; // live keys by probe length
+} hash_stats_t;
+
+void hash_dump (hash_t *, int); // for debugging if needed
+
+hash_t *hash_clone (hash_t *);
+char *hash_find (hash_t *, char *);
+void hash_free (hash_t *);
+unsigned long hash_generation (hash_t *);
+bool hash_insert (hash_t *, char *, char *);
+char **hash_keys (hash_t *);
+hash_t *hash_new (size_t);
+bool hash_remove (hash_t *, char *);
+void hash_stats (hash_t *, hash_stats_t *);
 
 #endif
@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "jobs.h"
+
+// Table of background jobs (pipelines started with a trailing '&').
+// Children are reaped asynchronously by the SIGCHLD handler, which only
+// waits on pids registered here, so the blocking waitpid() calls for
+// foreground commands never race with it. The main program blocks
+// SIGCHLD while it changes the table.
+//
+// There is no terminal job control: background children stay in the
+// shell's process group, and fg simply waits for the job.
+//
+// The table starts with INITIAL_JOBS slots and doubles when it is full,
+// so every background child is registered and eventually reaped.
+
+#define INITIAL_JOBS 64
+
+typedef struct job
+{
+  bool used;                       // slot holds a job
+  pid_t *pids;                     // one per stage, -1 for builtins
+  int *statuses;                   // return code of each stage
+  size_t nprocs;                   // number of stages
+  volatile sig_atomic_t remaining; // stages not yet reaped
+  char *cmdline;                   // command line for messages
+} job_t;
+
+static job_t *jobs = NULL; // njobs slots
+static int njobs = 0;
+static bool notify = false; // print start/done messages (interactive)
+static int last_job = 0;    // most recently started job id
+
+static void block_sigchld (sigset_t *);
+static void free_job (job_t *);
+static void reap (void);
+static void sigchld_handler (int);
+
+/* Installs the SIGCHLD handler. If announce is true, starting and
+   finishing jobs print messages, as an interactive shell would. */
+void
+jobs_init (bool announce)
+{
+  notify = announce;
+
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = sigchld_handler;
+  sigemptyset (&sa.sa_mask);
+  // Restart interrupted reads and foreground waitpid() calls
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction (SIGCHLD, &sa, NULL);
+}
+
+/* Registers a started pipeline as a background job. pids holds one pid
+   per stage (-1 for stages that already finished, such as builtins).
+
+   Returns the job id, or -1 if the table cannot grow (out of memory). */
+int
+jobs_add (pid_t *pids, size_t npids, const char *cmdline)
+{
+  sigset_t old;
+  block_sigchld (&old);
+
+  int id = -1;
+  for (int i = 0; i < njobs; i++)
+    if (!jobs[i].used)
+      {
+        id = i + 1;
+        break;
+      }
+
+  // Every slot is taken: double the table. SIGCHLD is blocked, so the
+  // handler never sees it half moved.
+  if (id == -1)
+    {
+      int cap = (njobs > 0) ? 2 * njobs : INITIAL_JOBS;
+      job_t *grown = realloc (jobs, cap * sizeof (job_t));
+      if (grown != NULL)
+        {
+          memset (grown + njobs, 0, (cap - njobs) * sizeof (job_t));
+          id = njobs + 1;
+          jobs = grown;
+          njobs = cap;
+        }
+    }
+
+  if (id != -1)
+    {
+      job_t *job = &jobs[id - 1];
+      job->pids = malloc (npids * sizeof (pid_t));
+      job->statuses = calloc (npids, sizeof (int));
+      memcpy (job->pids, pids, npids * sizeof (pid_t));
+      job->nprocs = npids;
+      job->remaining = 0;
+      for (size_t i = 0; i < npids; i++)
+        if (pids[i] != -1)
+          job->remaining++;
+      job->cmdline = strdup (cmdline);
+      job->used = true;
+      last_job = id;
+
+      // Children that exited before they were registered were skipped
+      // by the handler
+      reap ();
+
+      if (notify)
+        printf ("[%d] %d\n", id, (int)pids[npids - 1]);
+    }
+
+  sigprocmask (SIG_SETMASK, &old, NULL);
+  return id;
+}
+
+/* Prints every job and whether it is still running to fd. */
+void
+jobs_list (int fd)
+{
+  sigset_t old;
+  block_sigchld (&old);
+  for (int i = 0; i < njobs; i++)
+    if (jobs[i].used)
+      dprintf (fd, "[%d]%c %-8s%s\n", i + 1,
+               (i + 1 == last_job) ? '+' : ' ',
+               jobs[i].remaining > 0 ? "Running" : "Done", jobs[i].cmdline);
+  sigprocmask (SIG_SETMASK, &old, NULL);
+}
+
+/* Reports and forgets the jobs that finished since the last call. Called
+   before each command line is read. */
+void
+jobs_notify (void)
+{
+  sigset_t old;
+  block_sigchld (&old);
+  for (int i = 0; i < njobs; i++)
+    if (jobs[i].used && jobs[i].remaining == 0)
+      {
+        if (notify)
+          printf ("[%d]  Done\t%s\n", i + 1, jobs[i].cmdline);
+        free_job (&jobs[i]);
+      }
+  sigprocmask (SIG_SETMASK, &old, NULL);
+}
+
+/* Returns the id of the most recently started job that still exists, or
+   0 if there is none. */
+int
+jobs_last (void)
+{
+  if (last_job > 0 && jobs[last_job - 1].used)
+    return last_job;
+  for (int i = njobs - 1; i >= 0; i--)
+    if (jobs[i].used)
+      return i + 1;
+  return 0;
+}
+
+/* Waits for job id to finish and forgets it. An id of 0 waits for every
+   job. If show is true, the job's command line is printed first (fg).
+
+   Returns the return code of the job's last stage (0 when waiting for
+   every job), or -1 if there is no such job. */
+int
+jobs_wait (int id, bool show)
+{
+  if (id < 0 || id > njobs || (id != 0 && !jobs[id - 1].used))
+    return -1;
+
+  sigset_t old;
+  block_sigchld (&old);
+
+  int rc = 0;
+  for (int i = 0; i < njobs; i++)
+    {
+      if (!jobs[i].used || (id != 0 && i + 1 != id))
+        continue;
+
+      job_t *job = &jobs[i];
+      if (show)
+        {
+          printf ("%s\n", job->cmdline);
+          fflush (stdout);
+        }
+
+      // SIGCHLD is blocked here, so no child can exit unnoticed between
+      // the check and the suspend
+      while (job->remaining > 0)
+        sigsuspend (&old);
+
+      if (id != 0)
+        rc = job->statuses[job->nprocs - 1];
+      free_job (job);
+    }
+
+  sigprocmask (SIG_SETMASK, &old, NULL);
+  return rc;
+}
+
+/* **********************************************************************
+ *                Helper functions only below this point                *
+ * ********************************************************************** */
+
+static void
+block_sigchld (sigset_t *old)
+{
+  sigset_t set;
+  sigemptyset (&set);
+  sigaddset (&set, SIGCHLD);
+  sigprocmask (SIG_BLOCK, &set, old);
+}
+
+static void
+free_job (job_t *job)
+{
+  free (job->pids);
+  free (job->statuses);
+  free (job->cmdline);
+  memset (job, 0, sizeof (job_t));
+}
+
+/* Collects every registered child that has exited. Only uses
+   async-signal-safe calls, as it runs inside the SIGCHLD handler. */
+static void
+reap (void)
+{
+  for (int i = 0; i < njobs; i++)
+    {
+      job_t *job = &jobs[i];
+      if (!job->used || job->remaining == 0)
+        continue;
+
+      for (size_t p = 0; p < job->nprocs; p++)
+        {
+          if (job->pids[p] == -1)
+            continue;
+
+          int status;
+          if (waitpid (job->pids[p], &status, WNOHANG) != job->pids[p])
+            continue;
+
+          // a stage killed by a signal reports 128 plus its number
+          job->statuses[p] = WIFEXITED (status)     ? WEXITSTATUS (status)
+                             : WIFSIGNALED (status) ? 128 + WTERMSIG (status)
+                                                    : -1;
+          job->pids[p] = -1;
+          job->remaining--;
+        }
+    }
+}
+
+static void
+sigchld_handler (int sig)
+{
+  int saved = errno;
+  reap ();
+  errno = saved;
+}
@@ -0,0 +1,15 @@
+#ifndef __cs361_jobs__
+#define __cs361_jobs__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+void jobs_init (bool);
+int jobs_add (pid_t *, size_t, const char *);
+void jobs_list (int);
+void jobs_notify (void);
+int jobs_last (void);
+int jobs_wait (int, bool);
+
+#endif
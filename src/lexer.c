@@ -0,0 +1,319 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "arena.h"
+#include "lexer.h"
+
+// Command line tokenizer. One pass over the line produces an array of
+// tokens, each recording where it is in the line (offset and length) and
+// what it is: a word or one of the operators | & ; < > >>. Blanks (space,
+// tab, CR and LF) separate words; operators need no blanks around them.
+//
+// Quoting follows the shell:
+//   'text'   everything up to the next ' is literal
+//   "text"   literal, except that \" stands for ", \\ for a backslash
+//            and \$ for a $, and that variables are still expanded
+//   \c       outside quotes, c loses any special meaning if it is a
+//            blank, an operator, a quote, a backslash or a $. Before any
+//            other character the backslash is kept, so echo still sees \n.
+// Variables are expanded later (see expand.c), so a $ that must stay
+// literal is replaced by LITERAL_DOLLAR in the word's text.
+//
+// Words are not copied when that can be avoided. Removing quotes and
+// escapes only ever shortens a word, so it is done in place, and a word
+// that is followed by a blank is terminated by overwriting the blank.
+// Only a word that runs straight into an operator ("ls|wc") is copied
+// to the arena. The line is therefore modified, as strtok () would.
+//
+// Most words are plain, so the lexer first looks for the next special
+// byte 16 at a time (with SSE2 when available) and only walks bytes one
+// at a time inside quotes.
+
+// Byte classes
+enum
+{
+  PLAIN,    // part of a word
+  BLANK,    // separates words
+  OPERATOR, // | & ; < >
+  QUOTE,    // ' " and \, which start quoting or escaping
+  END       // the terminating NUL
+};
+
+static const uint8_t byte_class[256]
+    = { ['\0'] = END,     [' '] = BLANK,     ['\t'] = BLANK,
+        ['\r'] = BLANK,   ['\n'] = BLANK,    ['|'] = OPERATOR,
+        ['&'] = OPERATOR, [';'] = OPERATOR,  ['<'] = OPERATOR,
+        ['>'] = OPERATOR, ['\''] = QUOTE,    ['"'] = QUOTE,
+        ['\\'] = QUOTE };
+
+// Initial length of the token array; it grows as needed
+#define TOKENS_INITIAL 16
+
+static size_t lex_operator (char *, size_t, token_t *);
+static bool lex_word (char *, size_t, size_t *, token_t *);
+static size_t next_special (const char *, size_t, size_t);
+static size_t unquote (char *, size_t, size_t, size_t *);
+
+/* Splits a NUL-terminated line into tokens. Stores an arena array of
+   them in tokens and their number in ntokens. Returns false if a quote
+   is not closed, in which case the tokens before it are still stored. */
+bool
+lex_line (char *line, token_t **tokens, size_t *ntokens)
+{
+  size_t len = strlen (line);
+  size_t cap = TOKENS_INITIAL;
+  token_t *list = arena_alloc (cap * sizeof (token_t));
+  size_t count = 0;
+  bool ok = true;
+
+  size_t pos = 0;
+  while (true)
+    {
+      while (byte_class[(uint8_t)line[pos]] == BLANK)
+        pos++;
+      if (pos >= len)
+        break;
+
+      if (count == cap)
+        {
+          list = arena_grow (list, cap * sizeof (token_t),
+                             2 * cap * sizeof (token_t));
+          cap *= 2;
+        }
+      token_t *token = &list[count];
+      token->offset = pos;
+      if (byte_class[(uint8_t)line[pos]] == OPERATOR)
+        pos += lex_operator (line, pos, token);
+      else if (!lex_word (line, len, &pos, token))
+        {
+          ok = false;
+          break;
+        }
+      count++;
+    }
+
+  *tokens = list;
+  *ntokens = count;
+  return ok;
+}
+
+/* **********************************************************************
+ *                Helper functions only below this point                *
+ * ********************************************************************** */
+
+/* Fills in the operator that starts at pos. Returns its length. */
+static size_t
+lex_operator (char *line, size_t pos, token_t *token)
+{
+  token->length = 1;
+  switch (line[pos])
+    {
+    case '|':
+      token->kind = TOK_PIPE;
+      token->text = "|";
+      break;
+    case '&':
+      token->kind = TOK_AMP;
+      token->text = "&";
+      break;
+    case ';':
+      token->kind = TOK_SEMI;
+      token->text = ";";
+      break;
+    case '<':
+      token->kind = TOK_IN;
+      token->text = "<";
+      break;
+    default:
+      if (line[pos + 1] == '>')
+        {
+          token->kind = TOK_APPEND;
+          token->text = ">>";
+          token->length = 2;
+        }
+      else
+        {
+          token->kind = TOK_OUT;
+          token->text = ">";
+        }
+      break;
+    }
+  return token->length;
+}
+
+/* Fills in the word that starts at *pos and moves *pos past it (and past
+   the blank that follows, if that became its terminator). Returns false
+   if the word has a quote that is not closed. */
+static bool
+lex_word (char *line, size_t len, size_t *pos, token_t *token)
+{
+  size_t start = *pos;
+  size_t end = next_special (line, len, start);
+  size_t stop = end; // where the unquoted word ends (<= end)
+
+  // Quotes and escapes are removed by moving the rest of the word back
+  if (byte_class[(uint8_t)line[end]] == QUOTE)
+    {
+      end = unquote (line, len, end, &stop);
+      if (end == SIZE_MAX)
+        return false;
+    }
+
+  token->kind = TOK_WORD;
+  token->length = end - start;
+  *pos = end;
+  if (stop < end || byte_class[(uint8_t)line[end]] == END)
+    token->text = line + start;
+  else if (byte_class[(uint8_t)line[end]] == BLANK)
+    {
+      token->text = line + start;
+      (*pos)++;
+    }
+  else
+    {
+      // Terminating the word in place would overwrite the operator
+      token->text = arena_alloc (stop - start + 1);
+      memcpy (token->text, line + start, stop - start);
+      token->text[stop - start] = '\0';
+      return true;
+    }
+  line[stop] = '\0';
+  return true;
+}
+
+/* Index of the first byte at or after pos that is not PLAIN. The line's
+   NUL is not PLAIN, so this always stops before len. */
+static size_t
+next_special (const char *line, size_t len, size_t pos)
+{
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8 (' ');
+  const __m128i control = _mm_set1_epi8 (0x1F);
+  const __m128i pipe = _mm_set1_epi8 ('|');
+  const __m128i amp = _mm_set1_epi8 ('&');
+  const __m128i semi = _mm_set1_epi8 (';');
+  const __m128i less = _mm_set1_epi8 ('<');
+  const __m128i greater = _mm_set1_epi8 ('>');
+  const __m128i single = _mm_set1_epi8 ('\'');
+  const __m128i dquote = _mm_set1_epi8 ('"');
+  const __m128i backslash = _mm_set1_epi8 ('\\');
+  for (; pos + 16 <= len; pos += 16)
+    {
+      __m128i bytes = _mm_loadu_si128 ((const __m128i *)(line + pos));
+      // Every byte <= 0x1F is treated as a candidate; the scalar loop
+      // below decides the few that are really special
+      __m128i hits
+          = _mm_cmpeq_epi8 (_mm_max_epu8 (bytes, control), control);
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (bytes, space));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (bytes, pipe));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (bytes, amp));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (bytes, semi));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (bytes, less));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (bytes, greater));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (bytes, single));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (bytes, dquote));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (bytes, backslash));
+      unsigned mask = (unsigned)_mm_movemask_epi8 (hits);
+      if (mask != 0)
+        {
+          pos += (unsigned)__builtin_ctz (mask);
+          break;
+        }
+    }
+#else
+  (void)len;
+#endif
+
+  while (byte_class[(uint8_t)line[pos]] == PLAIN)
+    pos++;
+  return pos;
+}
+
+/* Removes the quotes and escapes of the word whose first special byte is
+   at pos, moving its text back over them. Stores where the word's text
+   now ends in stop. Returns the index just past the word in the line, or
+   SIZE_MAX if a quote is not closed. */
+static size_t
+unquote (char *line, size_t len, size_t pos, size_t *stop)
+{
+  size_t out = pos;
+  while (true)
+    {
+      char c = line[pos];
+      switch (byte_class[(uint8_t)c])
+        {
+        case PLAIN:
+          {
+            size_t end = next_special (line, len, pos);
+            memmove (line + out, line + pos, end - pos);
+            out += end - pos;
+            pos = end;
+            break;
+          }
+        case QUOTE:
+          if (c == '\'')
+            {
+              char *close = memchr (line + pos + 1, '\'', len - pos - 1);
+              if (close == NULL)
+                return SIZE_MAX;
+              size_t n = close - (line + pos + 1);
+              memmove (line + out, line + pos + 1, n);
+              for (size_t i = out; i < out + n; i++)
+                if (line[i] == '$')
+                  line[i] = LITERAL_DOLLAR;
+              out += n;
+              pos += n + 2;
+            }
+          else if (c == '"')
+            {
+              for (pos++; line[pos] != '"'; pos++)
+                {
+                  if (line[pos] == '\0')
+                    return SIZE_MAX;
+                  if (line[pos] == '\\' && line[pos + 1] == '$')
+                    {
+                      line[out++] = LITERAL_DOLLAR;
+                      pos++;
+                      continue;
+                    }
+                  if (line[pos] == '\\'
+                      && (line[pos + 1] == '"' || line[pos + 1] == '\\'))
+                    pos++;
+                  line[out++] = line[pos];
+                }
+              pos++;
+            }
+          else if (line[pos + 1] == '$')
+            {
+              line[out++] = LITERAL_DOLLAR;
+              pos += 2;
+            }
+          else if (byte_class[(uint8_t)line[pos + 1]] != PLAIN)
+            {
+              // An escaped special byte (the NUL cannot be escaped)
+              if (line[pos + 1] == '\0')
+                {
+                  line[out++] = '\\';
+                  pos++;
+                  break;
+                }
+              line[out++] = line[pos + 1];
+              pos += 2;
+            }
+          else
+            {
+              line[out++] = '\\';
+              pos++;
+            }
+          break;
+        default:
+          *stop = out;
+          return pos;
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef __cs361_lexer__
+#define __cs361_lexer__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Kinds of tokens found by lex_line ()
+typedef enum
+{
+  TOK_WORD,   // a word, with its quotes and escapes removed
+  TOK_PIPE,   // |
+  TOK_AMP,    // &
+  TOK_SEMI,   // ;
+  TOK_IN,     // <
+  TOK_OUT,    // >
+  TOK_APPEND  // >>
+} token_kind_t;
+
+// Stands for a $ in the text of a word that was quoted or escaped, and
+// so must not start a variable reference (see expand.c)
+#define LITERAL_DOLLAR '\001'
+
+// One token of a command line
+typedef struct token
+{
+  size_t offset;     // start of the token in the line
+  size_t length;     // bytes it spans in the line, quotes included
+  token_kind_t kind;
+  char *text;        // NUL-terminated word, or the operator's spelling
+} token_t;
+
+bool lex_line (char *, token_t **, size_t *);
+
+#endif
@@ -9,28 +9,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "arena.h"
+#include "compile.h"
 #include "hash.h"
+#include "process.h"
 #include "shell.h"
+#include "trace.h"
 
-static bool get_args (int, char **, FILE **);
+static bool get_args (int, char **, char **, bool *, char **);
 static void usage (void);
 
 int
 main (int argc, char *argv[])
 {
-  FILE *s = NULL;
-  if (!get_args (argc, argv, &s))
+  char *script = NULL;
+  char *trace = NULL;
+  bool compile_only = false;
+  if (!get_args (argc, argv, &script, &compile_only, &trace))
     usage ();
-  if (s == NULL)
+
+  if (trace != NULL && !trace_open (trace))
     {
-      // Opening the shell with STDIN if the file was not provided
-      shell (stdin);
+      perror (trace);
+      return EXIT_FAILURE;
     }
-  else
+
+  // Only build the compiled form of the script
+  if (compile_only)
     {
-      // Opening the shell with the provided file otherwise
-      shell (s);
+      if (script == NULL)
+        {
+          usage ();
+          return EXIT_FAILURE;
+        }
+      return compile_script (script) ? EXIT_SUCCESS : EXIT_FAILURE;
     }
+
+  // Opening the shell with STDIN if the file was not provided, and with
+  // the provided file otherwise
+  if (!shell (script))
+    return EXIT_FAILURE;
   return EXIT_SUCCESS;
 }
 
@@ -40,16 +58,42 @@ main (int argc, char *argv[])
    client/server. If -d was passed, turn on debugging mode to print
    information about state transitions. */
 static bool
-get_args (int argc, char **argv, FILE **script)
+get_args (int argc, char **argv, char **script, bool *compile_only,
+          char **trace)
 {
+  static const struct option longopts[]
+      = { { "compile-only", no_argument, NULL, 'c' },
+          { "no-cache", no_argument, NULL, 'n' },
+          { NULL, 0, NULL, 0 } };
+
   int ch = 0;
-  while ((ch = getopt (argc, argv, "b:h")) != -1)
+  while ((ch = getopt_long (argc, argv, "Ab:FhT:", longopts, NULL)) != -1)
     {
       switch (ch)
         {
         case 'b':
-          // open the provided file
-          *script = fopen (optarg, "r");
+          // the shell opens the provided file
+          *script = optarg;
+          break;
+        case 'A':
+          // print per-line arena usage on stderr
+          arena_stats (true);
+          break;
+        case 'c':
+          // compile the script into its cache and exit
+          *compile_only = true;
+          break;
+        case 'n':
+          // neither read nor write the compiled script cache
+          use_script_cache = false;
+          break;
+        case 'F':
+          // launch commands with fork()+execve() instead of posix_spawn()
+          use_fork = true;
+          break;
+        case 'T':
+          // write a Chrome trace of everything the shell does
+          *trace = optarg;
           break;
         default:
           return false;
@@ -63,8 +107,14 @@ static void
 usage (void)
 {
   printf ("dukesh, a simple command shell\n");
-  printf ("usage: dukesh [-b FILE]\n");
+  printf ("usage: dukesh [-AF] [--compile-only] [--no-cache] [-b FILE]\n");
+  printf ("              [-T TRACE]\n");
+  printf ("  -A         print memory used by each command line on stderr\n");
   printf ("  -b FILE    use FILE as a shell script to execute\n");
+  printf ("  -F         launch commands with fork() and execve()\n");
+  printf ("  -T TRACE   write a Chrome trace (JSON) of execution to TRACE\n");
+  printf ("  --compile-only  compile FILE into its cache and exit\n");
+  printf ("  --no-cache      do not use the compiled script cache\n");
   printf ("If no script is passed, then the shell should be interactive,\n");
   printf ("processing one command at a time from STDIN.\n");
 }
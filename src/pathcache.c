@@ -0,0 +1,255 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "pathcache.h"
+#include "shell.h"
+
+// Cache of resolved command paths, similar to bash's hash table. Every
+// external command used to rescan $PATH with one access() per directory;
+// now a command is looked up here first and only scanned on a miss.
+//
+// Entries are dropped when PATH is changed (export/unset call
+// path_cache_clear ()) or when the mtime of a PATH directory changes. A
+// hit found in directory k only depends on directories 0..k, so only
+// those are stat'ed, and each directory at most once per command line
+// (see path_cache_tick ()).
+
+#define NBUCKETS 64
+
+typedef struct pathdir
+{
+  char *name;
+  struct timespec mtime; // directory mtime when the cache was filled
+  unsigned long checked; // epoch of the last mtime check
+} pathdir_t;
+
+typedef struct pathent
+{
+  char *name;           // command name as typed
+  char *path;           // full path of the executable
+  size_t dir;           // index into dirs where it was found
+  unsigned long hits;   // number of lookups served
+  struct pathent *next; // bucket chain
+} pathent_t;
+
+static pathent_t *buckets[NBUCKETS];
+static pathdir_t *dirs = NULL;
+static size_t ndirs = 0;
+static bool dirs_loaded = false;
+static unsigned long epoch = 1;
+
+static bool dir_changed (size_t);
+static void load_dirs (void);
+static pathent_t *lookup_entry (const char *);
+static pathent_t *scan (const char *);
+static unsigned long strhash (const char *);
+
+/* Forgets every cached command and the PATH directory list. Called when
+   PATH itself changes. */
+void
+path_cache_clear (void)
+{
+  for (size_t b = 0; b < NBUCKETS; b++)
+    {
+      pathent_t *ent = buckets[b];
+      while (ent != NULL)
+        {
+          pathent_t *next = ent->next;
+          free (ent->name);
+          free (ent->path);
+          free (ent);
+          ent = next;
+        }
+      buckets[b] = NULL;
+    }
+
+  for (size_t i = 0; i < ndirs; i++)
+    free (dirs[i].name);
+  free (dirs);
+  dirs = NULL;
+  ndirs = 0;
+  dirs_loaded = false;
+}
+
+void
+path_cache_destroy (void)
+{
+  path_cache_clear ();
+}
+
+/* Prints the cached commands along with their hit counts to fd. */
+void
+path_cache_list (int fd)
+{
+  bool empty = true;
+  for (size_t b = 0; b < NBUCKETS; b++)
+    for (pathent_t *ent = buckets[b]; ent != NULL; ent = ent->next)
+      {
+        if (empty)
+          dprintf (fd, "hits\tcommand\n");
+        empty = false;
+        dprintf (fd, "%4lu\t%s\n", ent->hits, ent->path);
+      }
+  if (empty)
+    dprintf (fd, "hash: hash table empty\n");
+}
+
+/* Marks the start of a new command line. Directory mtimes are re-checked
+   at most once per tick, so all stages of a pipeline share one stat. */
+void
+path_cache_tick (void)
+{
+  epoch++;
+}
+
+/* Resolves a command and stores it without counting a hit. Returns false
+   if the command cannot be found in PATH. */
+bool
+path_cache_add (const char *cmd)
+{
+  return lookup_entry (cmd) != NULL;
+}
+
+/* Finds the full path of a command by searching PATH (the shell variable
+   if exported, the process environment otherwise). The returned string
+   is owned by the cache and stays valid until the cache is cleared,
+   which any later lookup may do; copy it to keep it across lookups.
+   Returns NULL if the command is not found or contains a '/'. */
+const char *
+path_lookup (const char *cmd)
+{
+  pathent_t *ent = lookup_entry (cmd);
+  if (ent == NULL)
+    return NULL;
+
+  ent->hits++;
+  return ent->path;
+}
+
+/* **********************************************************************
+ *                Helper functions only below this point                *
+ * ********************************************************************** */
+
+static bool
+dir_changed (size_t index)
+{
+  pathdir_t *dir = &dirs[index];
+  if (dir->checked == epoch)
+    return false;
+  dir->checked = epoch;
+
+  struct stat st;
+  struct timespec now = { 0, 0 };
+  if (stat (dir->name, &st) == 0)
+    now = st.st_mtim;
+
+  return now.tv_sec != dir->mtime.tv_sec
+         || now.tv_nsec != dir->mtime.tv_nsec;
+}
+
+static void
+load_dirs (void)
+{
+  char *path_env = hash_find (shell_vars, "PATH");
+  if (path_env == NULL)
+    path_env = getenv ("PATH");
+  dirs_loaded = true;
+  if (path_env == NULL)
+    return;
+
+  // Make a copy of PATH and split it on ':'
+  char *paths = strdup (path_env);
+  size_t cap = 8;
+  dirs = calloc (cap, sizeof (pathdir_t));
+  for (char *token = strtok (paths, ":"); token != NULL;
+       token = strtok (NULL, ":"))
+    {
+      if (ndirs == cap)
+        {
+          cap *= 2;
+          dirs = realloc (dirs, cap * sizeof (pathdir_t));
+        }
+      pathdir_t *dir = &dirs[ndirs++];
+      dir->name = strdup (token);
+      dir->mtime.tv_sec = 0;
+      dir->mtime.tv_nsec = 0;
+      dir->checked = epoch;
+
+      struct stat st;
+      if (stat (dir->name, &st) == 0)
+        dir->mtime = st.st_mtim;
+    }
+  free (paths);
+}
+
+static pathent_t *
+lookup_entry (const char *cmd)
+{
+  if (strchr (cmd, '/') != NULL)
+    return NULL;
+
+  if (!dirs_loaded)
+    load_dirs ();
+
+  pathent_t *ent = buckets[strhash (cmd) % NBUCKETS];
+  while (ent != NULL && strcmp (ent->name, cmd))
+    ent = ent->next;
+
+  if (ent != NULL)
+    {
+      // A new file in an earlier directory or a removal from the
+      // directory that holds the hit both bump an mtime we check here
+      for (size_t i = 0; i <= ent->dir; i++)
+        if (dir_changed (i))
+          {
+            path_cache_clear ();
+            load_dirs ();
+            ent = NULL;
+            break;
+          }
+    }
+
+  if (ent == NULL)
+    ent = scan (cmd);
+  return ent;
+}
+
+static pathent_t *
+scan (const char *cmd)
+{
+  // Check each directory in PATH
+  for (size_t i = 0; i < ndirs; i++)
+    {
+      char fullpath[1024];
+      snprintf (fullpath, sizeof (fullpath), "%s/%s", dirs[i].name, cmd);
+      if (access (fullpath, X_OK) != 0)
+        continue;
+
+      pathent_t *ent = calloc (1, sizeof (pathent_t));
+      ent->name = strdup (cmd);
+      ent->path = strdup (fullpath);
+      ent->dir = i;
+
+      size_t b = strhash (cmd) % NBUCKETS;
+      ent->next = buckets[b];
+      buckets[b] = ent;
+      return ent;
+    }
+  return NULL;
+}
+
+static unsigned long
+strhash (const char *string)
+{
+  // djb2, same as the variable table
+  unsigned long hash = 5381;
+  for (const unsigned char *ptr = (const unsigned char *)string;
+       *ptr != '\0'; ptr++)
+    hash = ((hash << 5) + hash) + *ptr;
+  return hash;
+}
@@ -0,0 +1,13 @@
+#ifndef __cs361_pathcache__
+#define __cs361_pathcache__
+
+#include <stdbool.h>
+
+void path_cache_clear (void);
+void path_cache_destroy (void);
+void path_cache_list (int);
+void path_cache_tick (void);
+bool path_cache_add (const char *);
+const char *path_lookup (const char *);
+
+#endif
@@ -1,14 +1,29 @@
+// wait4 () is not part of POSIX
+#define _DEFAULT_SOURCE
+
 #include <fcntl.h>
+#include <signal.h>
 #include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "builtins.h"
+#include "expand.h"
 #include "hash.h"
+#include "jobs.h"
+#include "pathcache.h"
+#include "process.h"
+#include "shell.h"
+#include "tools.h"
+#include "trace.h"
 
 // The contents of this file are up to you, but they should be related to
 // running separate processes. It is recommended that you have functions
@@ -16,257 +31,725 @@
 //   - performing a $PATH lookup
 //   - determining if a command is a built-in or executable
 //   - running a single command in a second process
-//   - running a pair of commands that are connected with a pipe
+//   - running a pipeline of commands connected with pipes
 
 // You should provide some function like this to serve as the interface to
 // parsing the command line. This function is just a placeholder and you
 // should define your own.
 
-int process_num = 1;
-
-bool
-run_builtin (char *str, char *cmd[])
+// Launch external commands with fork()+execve() instead of posix_spawn()
+#ifdef DUKESH_FORK_LAUNCH
+bool use_fork = true;
+#else
+bool use_fork = false;
+#endif
+
+// Default number of measured and warmup runs of the bench prefix
+#define BENCH_RUNS 10
+#define BENCH_WARMUP 1
+
+// Return codes counted by bench: -1 (no normal exit) through 255
+#define BENCH_CODES 257
+
+// Environment snapshot handed to every child, and the hash table
+// generation it was built from
+static char **env_snapshot = NULL;
+static unsigned long env_generation = 0;
+
+// Builds the enviroment array for spawned children. It takes all
+// key-value pairs and puts them in a KEY=VALUE string, followed by the
+// shell's own PATH unless PATH was exported.
+//
+// The array is only rebuilt when the variable table has changed since the
+// last call, so consecutive launches share one snapshot. Pointers and
+// strings live in a single allocation.
+
+// Returns the snapshot (owned by this file, do not free)
+static char **
+build_env (void)
 {
-  // check for all possible builtin functions
-  if (strcmp (cmd[0], "quit") == 0)
-    {
-      printf ("\n");
-      // just exits the shell
-      exit (0);
-    }
-  if (strcmp (cmd[0], "echo") == 0)
-    {
-      // runs the echo function form builtins
-      echo (str);
-      return true;
-    }
-  if (strcmp (cmd[0], "pwd") == 0)
+  unsigned long generation = hash_generation (shell_vars);
+  if (env_snapshot != NULL && env_generation == generation)
+    return env_snapshot;
+
+  // Get a list of all keys from hash table
+  char **keys = hash_keys (shell_vars);
+  size_t num_keys = 0;
+  size_t bytes = 0;
+
+  // Count the keys and the room their key=value strings need
+  for (; keys[num_keys] != NULL; num_keys++)
+    bytes += strlen (keys[num_keys])
+             + strlen (hash_find (shell_vars, keys[num_keys])) + 2;
+
+  char *path = NULL;
+  if (hash_find (shell_vars, "PATH") == NULL)
+    path = getenv ("PATH");
+  if (path != NULL)
+    bytes += strlen ("PATH=") + strlen (path) + 1;
+
+  // Pointer array first, strings packed after it
+  size_t slots = num_keys + 2;
+  free (env_snapshot);
+  env_snapshot = malloc (slots * sizeof (char *) + bytes);
+  char *next = (char *)(env_snapshot + slots);
+  size_t index = 0;
+
+  for (size_t i = 0; i < num_keys; i++)
     {
-      // runs pwd from bultins
-      pwd ();
-      return true;
+      char *value = hash_find (shell_vars, keys[i]);
+      env_snapshot[index++] = next;
+      next += sprintf (next, "%s=%s", keys[i], value) + 1;
     }
-  if (strcmp (cmd[0], "cd") == 0)
+  free (keys);
+
+  // Add PATH to the enviroment
+  if (path != NULL)
     {
-      // runs chdir from builtins
-      chdir (cmd[1]);
-      return true;
+      env_snapshot[index++] = next;
+      next += sprintf (next, "PATH=%s", path) + 1;
     }
-  if (strcmp (cmd[0], "which") == 0)
+
+  // NULL terminate array
+  env_snapshot[index] = NULL;
+  env_generation = generation;
+  return env_snapshot;
+}
+
+// Resolves the path of a command through the command path cache
+
+// Returns the full path (owned by the cache, do not free), or NULL if not
+// found
+const char *
+resolve_path (const char *cmd)
+{
+  // If command contains '/' assume explicit path
+  if (strchr (cmd, '/'))
+    return cmd;
+
+  return path_lookup (cmd);
+}
+
+// Starts a command with fork() and execve(). The child moves in_fd/out_fd
+// onto STDIN/STDOUT (if not -1). All pipe ends are close-on-exec, so the
+// other ends of the pipeline are closed by the execve.
+
+// Returns the child's pid, or -1 if fork failed
+static pid_t
+launch_fork (const char *path, char *cmd[], char *env[], int in_fd,
+             int out_fd)
+{
+  pid_t pid = fork ();
+  if (pid != 0)
+    return pid;
+
+  if (in_fd != -1)
+    dup2 (in_fd, STDIN_FILENO);
+  if (out_fd != -1)
+    dup2 (out_fd, STDOUT_FILENO);
+
+  if (path != NULL)
+    execve (path, cmd, env);
+  _exit (1);
+}
+
+// Starts a command with posix_spawn(), which glibc implements with
+// clone(CLONE_VM|CLONE_VFORK), so the cost does not grow with the size
+// of the shell. The pipe setup is expressed as spawn file actions.
+
+// Returns the child's pid, or -1 if the command could not be started
+static pid_t
+launch_spawn (const char *path, char *cmd[], char *env[], int in_fd,
+              int out_fd)
+{
+  if (path == NULL)
+    return -1;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init (&actions);
+  if (in_fd != -1)
+    posix_spawn_file_actions_adddup2 (&actions, in_fd, STDIN_FILENO);
+  if (out_fd != -1)
+    posix_spawn_file_actions_adddup2 (&actions, out_fd, STDOUT_FILENO);
+
+  pid_t pid;
+  int err = posix_spawn (&pid, path, &actions, NULL, cmd, env);
+  posix_spawn_file_actions_destroy (&actions);
+  if (err != 0)
+    return -1;
+  return pid;
+}
+
+// Starts a command with whichever launcher is selected (see use_fork)
+static pid_t
+launch (const char *path, char *cmd[], int in_fd, int out_fd)
+{
+  // Output of earlier builtins must come out before the child's
+  fflush (stdout);
+
+  // The snapshot is shared by the parent and every child
+  double start = trace_now ();
+  char **env = build_env ();
+  trace_span ("build_env", "exec", start, NULL);
+
+  // posix_spawn () returns once the child has called execve (), so its
+  // span includes the exec; fork () returns before
+  start = trace_now ();
+  pid_t pid;
+  if (use_fork)
+    pid = launch_fork (path, cmd, env, in_fd, out_fd);
+  else
+    pid = launch_spawn (path, cmd, env, in_fd, out_fd);
+  trace_span (use_fork ? "fork" : "spawn", "exec", start, cmd[0]);
+  return pid;
+}
+
+// Opens the files a stage redirects its input and output to, storing
+// their (close-on-exec) descriptors in in_file and out_file, or -1 if
+// there is no such redirection. A file that cannot be opened is
+// reported on STDERR.
+
+// Returns false if a file could not be opened
+static bool
+open_redirects (stage_t *stage, int *in_file, int *out_file)
+{
+  *in_file = *out_file = -1;
+  if (stage->in_file != NULL
+      && (*in_file = open (stage->in_file, O_RDONLY | O_CLOEXEC)) == -1)
     {
-      // runs which from builtins
-      which (cmd[1]);
-      return true;
+      fflush (stdout);
+      perror (stage->in_file);
+      return false;
     }
-  if (strcmp (cmd[0], "export") == 0)
+
+  if (stage->out_file != NULL)
     {
-      // runs export from builtins
-      export (cmd[1]);
-      return true;
+      int flags = O_WRONLY | O_CREAT | O_CLOEXEC
+                  | (stage->append ? O_APPEND : O_TRUNC);
+      if ((*out_file = open (stage->out_file, flags, 0666)) == -1)
+        {
+          fflush (stdout);
+          perror (stage->out_file);
+          if (*in_file != -1)
+            close (*in_file);
+          *in_file = -1;
+          return false;
+        }
     }
-  if (strcmp (cmd[0], "unset") == 0)
+  return true;
+}
+
+// Starts a builtin or a linked utility (see tools.c) that does not run in
+// the shell itself in a child made with fork () and no exec, with
+// in_fd/out_fd (if not -1) as its input and output. Without an execve ()
+// the close-on-exec pipe ends are inherited, so the child closes the ones
+// still open in pipes (npipes entries, -1 for closed) other than its own.
+
+// Returns the child's pid, or -1 if fork failed
+static pid_t
+launch_builtin (builtin_fn run, char *cmd[], int in_fd, int out_fd,
+                int *pipes, size_t npipes)
+{
+  fflush (stdout);
+  double start = trace_now ();
+  pid_t pid = fork ();
+  if (pid != 0)
     {
-      // runs unset from builtins
-      unset (cmd[1]);
-      return true;
+      trace_span ("fork", "exec", start, cmd[0]);
+      return pid;
     }
-  return false;
+
+  for (size_t p = 0; p < npipes; p++)
+    if (pipes[p] != -1 && pipes[p] != in_fd && pipes[p] != out_fd)
+      close (pipes[p]);
+  _exit (builtin_run (run, cmd, (in_fd != -1) ? in_fd : STDIN_FILENO,
+                      (out_fd != -1) ? out_fd : STDOUT_FILENO));
 }
 
-// Builds a new enviroment array when spawning child.
-// It takes all key-value pairs and puts them in a KEY=VALUE string
+// Waits for a child and converts its status into a return code. If usage
+// is not NULL, it receives the resources the child used.
 
-// Returns a set of string
-static char **
-build_env (void)
+// Returns the exit status, 128 plus the signal number if the child was
+// killed by a signal (as other shells report it), or -1 if it could not
+// be waited for
+static int
+wait_child (pid_t pid, struct rusage *usage)
 {
+  int status;
+  if (usage != NULL)
+    memset (usage, 0, sizeof (struct rusage));
+  if (wait4 (pid, &status, 0, usage) == -1)
+    return -1;
+  if (WIFEXITED (status))
+    return WEXITSTATUS (status);
+  if (WIFSIGNALED (status))
+    return 128 + WTERMSIG (status);
+  return -1;
+}
 
-  // Get a list of all keys from hash table
-  char **keys = hash_keys ();
-  int num_keys = 0;
+// Rebuilds the text of a stage from its arguments and redirections, for
+// messages such as jobs listings and time reports. Quotes are not
+// restored.
 
-  // Count number of keys that are in the array
-  while (keys[num_keys] != NULL)
-    num_keys++;
+// Returns a string in the line's arena
+static char *
+stage_text (stage_t *stage)
+{
+  size_t len = 1;
+  for (size_t i = 0; stage->argv[i] != NULL; i++)
+    len += strlen (stage->argv[i]) + 1;
+  if (stage->in_file != NULL)
+    len += strlen (stage->in_file) + 3;
+  if (stage->out_file != NULL)
+    len += strlen (stage->out_file) + 4;
+
+  char *text = arena_alloc (len);
+  char *next = text;
+  for (size_t i = 0; stage->argv[i] != NULL; i++)
+    next += sprintf (next, i == 0 ? "%s" : " %s", stage->argv[i]);
+  if (stage->in_file != NULL)
+    next += sprintf (next, " < %s", stage->in_file);
+  if (stage->out_file != NULL)
+    sprintf (next, " %s %s", stage->append ? ">>" : ">", stage->out_file);
+  return text;
+}
 
-  // Allocate space for all key=value paris
-  char **env = malloc ((num_keys + 2) * sizeof (char *));
-  int index = 0;
+// Registers a pipeline that was started in the background as a job
 
-  // For each key in hash table, build string
-  for (int i = 1; i < num_keys + 1; i++)
+// Returns the job id, or -1 if the job could not be registered
+static int
+add_job (stage_t *stages, size_t nstages, pid_t *pids)
+{
+  // Rebuild the whole command line for jobs and fg
+  size_t len = 1;
+  char **texts = arena_alloc (nstages * sizeof (char *));
+  for (size_t i = 0; i < nstages; i++)
+    {
+      texts[i] = stage_text (&stages[i]);
+      len += strlen (texts[i]) + 3;
+    }
+  char *cmdline = arena_calloc (len, 1);
+  for (size_t i = 0; i < nstages; i++)
     {
-      char *key = keys[i - 1];
-      char *value = hash_find (key);
-      size_t len = strlen (key) + strlen (value) + 2;
+      if (i > 0)
+        strcat (cmdline, " | ");
+      strcat (cmdline, texts[i]);
+    }
 
-      // Allocate and format string
-      char *kv = malloc (len);
-      snprintf (kv, len, "%s=%s", key, value);
+  return jobs_add (pids, nstages, cmdline);
+}
 
-      // Store it in the enviroment array
-      env[index++] = kv;
-    }
+// Stores in usage the resources the shell used since before was taken
+// (for a builtin, which runs in the shell). The peak RSS is the shell's.
+static void
+self_usage (const struct rusage *before, struct rusage *usage)
+{
+  struct rusage now;
+  getrusage (RUSAGE_SELF, &now);
+  memset (usage, 0, sizeof (struct rusage));
+  timersub (&now.ru_utime, &before->ru_utime, &usage->ru_utime);
+  timersub (&now.ru_stime, &before->ru_stime, &usage->ru_stime);
+  usage->ru_maxrss = now.ru_maxrss;
+  usage->ru_nvcsw = now.ru_nvcsw - before->ru_nvcsw;
+  usage->ru_nivcsw = now.ru_nivcsw - before->ru_nivcsw;
+}
 
-  free (keys);
+static double
+seconds (struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
 
-  // Add PATH to the enviroment
-  char *path = getenv ("PATH");
-  char *path_equals = "PATH=";
-  size_t total_length = strlen (path) + strlen (path_equals) + 1;
+// Prints what a timed pipeline used on STDERR: wall time, total user and
+// system CPU time, the largest peak RSS of any stage, and voluntary and
+// involuntary context switches, followed by one line per stage if there
+// is more than one. The totals are also stored in $RUSAGE as
+// "real=S user=S sys=S maxrss=KB vcsw=N ivcsw=N", and the CPU time
+// (user + sys) of each stage in $RUSAGE_STAGES, in the same order as
+// $PIPESTATUS.
+static void
+report_usage (stage_t *stages, size_t nstages, struct rusage *usage,
+              double real)
+{
+  double user = 0;
+  double sys = 0;
+  long maxrss = 0;
+  long vcsw = 0;
+  long ivcsw = 0;
+  for (size_t i = 0; i < nstages; i++)
+    {
+      user += seconds (usage[i].ru_utime);
+      sys += seconds (usage[i].ru_stime);
+      if (usage[i].ru_maxrss > maxrss)
+        maxrss = usage[i].ru_maxrss;
+      vcsw += usage[i].ru_nvcsw;
+      ivcsw += usage[i].ru_nivcsw;
+    }
 
-  // Allocate and build PATH=value
-  char *result = calloc (total_length, sizeof (char));
-  strncpy (result, path_equals, total_length * sizeof (char));
-  strncat (result, path, sizeof (result) - strlen ((result)-1));
-  env[index++] = result;
+  // Keep the report after whatever the pipeline printed
+  fflush (stdout);
+  fprintf (stderr, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ldk  "
+                   "csw %ld/%ld\n",
+           real, user, sys, maxrss, vcsw, ivcsw);
+  if (nstages > 1)
+    for (size_t i = 0; i < nstages; i++)
+      fprintf (stderr, "  [%zu] user %.3fs  sys %.3fs  maxrss %ldk  "
+                       "csw %ld/%ld  %s\n",
+               i + 1, seconds (usage[i].ru_utime),
+               seconds (usage[i].ru_stime), usage[i].ru_maxrss,
+               usage[i].ru_nvcsw, usage[i].ru_nivcsw,
+               stage_text (&stages[i]));
+
+  char summary[160];
+  snprintf (summary, sizeof (summary),
+            "real=%.6f user=%.6f sys=%.6f maxrss=%ld vcsw=%ld ivcsw=%ld",
+            real, user, sys, maxrss, vcsw, ivcsw);
+  hash_insert (shell_vars, "RUSAGE", summary);
+
+  // Each time takes at most 20 characters plus a separator
+  char *per_stage = arena_alloc (nstages * 21);
+  char *next = per_stage;
+  for (size_t i = 0; i < nstages; i++)
+    next += sprintf (next, i == 0 ? "%.6f" : " %.6f",
+                     seconds (usage[i].ru_utime)
+                         + seconds (usage[i].ru_stime));
+  hash_insert (shell_vars, "RUSAGE_STAGES", per_stage);
+}
 
-  // NULL terminate array
-  env[index] = NULL;
-  return env;
+// Strips the bench prefix and its options from stage, storing the number
+// of measured and warmup runs. The options are "-n N" and "-w WARMUP".
+
+// Returns false, leaving stage, runs and warmup alone, if an option is
+// malformed or no command follows them
+static bool
+strip_bench (stage_t *stage, size_t *runs, size_t *warmup)
+{
+  size_t n_runs = BENCH_RUNS;
+  size_t n_warmup = BENCH_WARMUP;
+  char **argv = stage->argv + 1;
+  while (argv[0] != NULL && argv[0][0] == '-')
+    {
+      if ((strcmp (argv[0], "-n") && strcmp (argv[0], "-w"))
+          || argv[1] == NULL)
+        return false;
+
+      char *end;
+      unsigned long n = strtoul (argv[1], &end, 10);
+      if (*end != '\0' || end == argv[1] || argv[1][0] == '-')
+        return false;
+      if (argv[0][1] == 'n')
+        n_runs = n;
+      else
+        n_warmup = n;
+      argv += 2;
+    }
+  if (argv[0] == NULL || n_runs == 0)
+    return false;
+
+  *runs = n_runs;
+  *warmup = n_warmup;
+  stage->argv = argv;
+  stage->builtin = builtin_lookup (argv[0]);
+  return true;
 }
 
-// Resolves the path of a command
+static int
+compare_times (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
 
-// Returns string with the full path, or NULL of not found
-char *
-resolve_path (const char *cmd)
+// Prints the wall times (in seconds) of the measured runs of a bench on
+// STDERR, followed by how many runs ended with each return code. The
+// times are also stored in $BENCH as
+// "runs=N min=S p50=S p90=S p99=S max=S mean=S", and the return codes in
+// $BENCH_CODES as a space-separated list of CODE:COUNT pairs.
+static void
+report_bench (double *times, size_t runs, size_t *codes)
 {
-  // If command contains '/' assume explicit path
-  if (strchr (cmd, '/'))
-    return strdup (cmd);
+  double total = 0;
+  for (size_t i = 0; i < runs; i++)
+    total += times[i];
+  qsort (times, runs, sizeof (double), compare_times);
+  double p50 = times[runs / 2];
+  double p90 = times[(size_t)(runs * 0.9)];
+  double p99 = times[(size_t)(runs * 0.99)];
+
+  fflush (stdout);
+  fprintf (stderr, "bench: %zu runs  min %.3fms  p50 %.3fms  p90 %.3fms  "
+                   "p99 %.3fms  max %.3fms  mean %.3fms\n",
+           runs, times[0] * 1e3, p50 * 1e3, p90 * 1e3, p99 * 1e3,
+           times[runs - 1] * 1e3, total / runs * 1e3);
+
+  char summary[200];
+  snprintf (summary, sizeof (summary),
+            "runs=%zu min=%.6f p50=%.6f p90=%.6f p99=%.6f max=%.6f "
+            "mean=%.6f",
+            runs, times[0], p50, p90, p99, times[runs - 1], total / runs);
+  hash_insert (shell_vars, "BENCH", summary);
+
+  // codes[0] counts -1 (no normal exit); each pair takes at most 33
+  // characters plus a separator
+  char *list = arena_alloc (BENCH_CODES * 34);
+  char *next = list;
+  fprintf (stderr, "  exit codes:");
+  for (int code = -1; code + 1 < BENCH_CODES; code++)
+    if (codes[code + 1] > 0)
+      {
+        fprintf (stderr, " %d (%zu)", code, codes[code + 1]);
+        next += sprintf (next, next == list ? "%d:%zu" : " %d:%zu", code,
+                         codes[code + 1]);
+      }
+  fprintf (stderr, "\n");
+  hash_insert (shell_vars, "BENCH_CODES", list);
+}
 
-  // Gets PATH enviroment variable
-  char *path_env = getenv ("PATH");
-  if (!path_env)
-    return NULL;
+// Runs the stages of a pipeline, connecting the output of each stage to
+// the input of the next. All pipes are created up front and every stage
+// is started before any is waited on. A redirection replaces the
+// stage's end of the pipe.
+//
+// Builtins and the utilities linked into the shell (see tools.c) never
+// exec. One that is the whole pipeline or its first stage runs in the
+// shell itself, so a producer such as echo writes into the pipe without
+// any process being created; it runs once the other stages have started,
+// so that they drain the pipe. One in a later stage runs in a forked
+// child (see launch_builtin), and so does a utility in a background
+// pipeline. With background set, the stages are handed to the job table
+// instead of being waited on.
+
+// Fills statuses[i] with the return code of stage i (1 if the command
+// could not be started), and usage[i] (unless usage is NULL) with the
+// resources stage i used: from wait4 () for a command, and the change in
+// the shell's own usage for a builtin. Returns the return code of the
+// last stage, or 0 for a background pipeline.
+int
+run_pipeline (stage_t *stages, size_t nstages, int *statuses,
+              bool background, struct rusage *usage)
+{
+  pid_t *pids = arena_calloc (nstages, sizeof (pid_t));
+  double *started = arena_alloc (nstages * sizeof (double));
+  int *pipes = arena_alloc (2 * nstages * sizeof (int));
 
-  // Make a copy of PATH
-  char *paths = strdup (path_env);
-  char *token = strtok (paths, ":");
+  // pipes[2*i] is read by stage i+1, pipes[2*i+1] is written by stage i
+  for (size_t i = 0; i + 1 < nstages; i++)
+    {
+      if (pipe (&pipes[2 * i]) == -1)
+        {
+          pipes[2 * i] = pipes[2 * i + 1] = -1;
+          continue;
+        }
+      fcntl (pipes[2 * i], F_SETFD, FD_CLOEXEC);
+      fcntl (pipes[2 * i + 1], F_SETFD, FD_CLOEXEC);
+    }
 
-  // Check ech directory in PATH
-  while (token)
+  // Commands are resolved in the parent so the path cache outlives the
+  // children. Builtins and linked utilities (see tools.c) run without an
+  // exec. Resolving a later stage may clear the cache, so each path is
+  // copied into the line's arena rather than kept as the cache's string.
+  const char **paths = arena_calloc (nstages, sizeof (char *));
+  builtin_fn *handlers = arena_calloc (nstages, sizeof (builtin_fn));
+  for (size_t i = 0; i < nstages; i++)
+    if (stages[i].builtin != BUILTIN_NONE)
+      handlers[i] = builtin_handler (stages[i].builtin);
+    else
+      {
+        double start = trace_now ();
+        const char *path = resolve_path (stages[i].argv[0]);
+        paths[i] = (path != NULL) ? arena_strdup (path) : NULL;
+        handlers[i] = tool_lookup (paths[i]);
+        trace_span ("resolve_path", "exec", start, stages[i].argv[0]);
+      }
+
+  size_t first = (nstages > 1 && handlers[0] != NULL);
+  for (size_t k = 0; k < nstages; k++)
     {
-      char fullpath[1024];
-      snprintf (fullpath, sizeof (fullpath), "%s/%s", token, cmd);
+      size_t i = (first + k) % nstages;
+      int in_fd = (i > 0) ? pipes[2 * (i - 1)] : -1;
+      int out_fd = (i + 1 < nstages) ? pipes[2 * i + 1] : -1;
+
+      pids[i] = -1;
+      statuses[i] = 0;
+      started[i] = trace_now ();
+      int in_file;
+      int out_file;
+      if (!open_redirects (&stages[i], &in_file, &out_file))
+        statuses[i] = 1;
+      else if (handlers[i] != NULL
+               && (i > 0
+                   || (background && stages[i].builtin == BUILTIN_NONE)))
+        {
+          pids[i] = launch_builtin (handlers[i], stages[i].argv,
+                                    (in_file != -1) ? in_file : in_fd,
+                                    (out_file != -1) ? out_file : out_fd,
+                                    pipes, 2 * (nstages - 1));
+          if (pids[i] == -1)
+            statuses[i] = 1;
+        }
+      else if (handlers[i] != NULL)
+        {
+          struct rusage before;
+          if (usage != NULL)
+            getrusage (RUSAGE_SELF, &before);
+          // A reader that exits early must not kill the shell, so
+          // SIGPIPE is held back. One that arrived is taken and reported
+          // as 128 + SIGPIPE, as if the stage had run in a child.
+          sigset_t sigpipe;
+          sigset_t mask;
+          sigemptyset (&sigpipe);
+          sigaddset (&sigpipe, SIGPIPE);
+          sigprocmask (SIG_BLOCK, &sigpipe, &mask);
+          statuses[i] = builtin_run (
+              handlers[i], stages[i].argv,
+              (in_file != -1) ? in_file : STDIN_FILENO,
+              (out_file != -1) ? out_file
+                               : (out_fd != -1) ? out_fd : STDOUT_FILENO);
+          sigset_t pending;
+          int sig;
+          sigpending (&pending);
+          if (sigismember (&pending, SIGPIPE) && sigwait (&sigpipe, &sig) == 0)
+            statuses[i] = 128 + SIGPIPE;
+          sigprocmask (SIG_SETMASK, &mask, NULL);
+          trace_span ("builtin", "exec", started[i],
+                      started[i] != 0 ? stage_text (&stages[i]) : NULL);
+          if (usage != NULL)
+            self_usage (&before, &usage[i]);
+        }
+      else
+        {
+          // A redirection takes the place of the pipe
+          pids[i] = launch (paths[i], stages[i].argv,
+                            (in_file != -1) ? in_file : in_fd,
+                            (out_file != -1) ? out_file : out_fd);
+          if (pids[i] == -1)
+            statuses[i] = 1;
+        }
 
-      // Return full path if file exists
-      if (access (fullpath, X_OK) == 0)
+      // The children hold their own copies of these now. Closed pipe ends
+      // are marked, so launch_builtin () does not close a reused number.
+      if (in_fd != -1)
         {
-          free (paths);
-          return strdup (fullpath);
+          close (in_fd);
+          pipes[2 * (i - 1)] = -1;
         }
-      // Move to next PATH
-      token = strtok (NULL, ":");
+      if (out_fd != -1)
+        {
+          close (out_fd);
+          pipes[2 * i + 1] = -1;
+        }
+      if (in_file != -1)
+        close (in_file);
+      if (out_file != -1)
+        close (out_file);
     }
-  free (paths);
-  return NULL;
+
+  if (background)
+    {
+      if (add_job (stages, nstages, pids) != -1)
+        return 0;
+      // Nothing would ever reap an unregistered child, so wait for it
+      fprintf (stderr, "dukesh: cannot start a job, running it in the "
+                       "foreground\n");
+    }
+
+  for (size_t i = 0; i < nstages; i++)
+    if (pids[i] != -1)
+      {
+        double start = trace_now ();
+        statuses[i] = wait_child (pids[i], usage ? &usage[i] : NULL);
+        if (start != 0)
+          {
+            char *label = stage_text (&stages[i]);
+            trace_span ("wait", "exec", start, label);
+            trace_track (pids[i], label, started[i], trace_now ());
+          }
+      }
+
+  return statuses[nstages - 1];
 }
 
-int
-run_process (char *str, char *cmd[], int fd[])
+// Runs a pipeline and records its results. Variables in its words are
+// expanded first (see expand.c). The return code of the last
+// stage becomes $? and the return codes of all stages are stored as a
+// space-separated list in $PIPESTATUS. A background pipeline reports 0
+// for every stage.
+//
+// A pipeline that starts with the time prefix also has the resources it
+// used reported (see report_usage). time is ignored for a background
+// pipeline, which is not waited for.
+//
+// A pipeline that starts with the bench prefix (after any time prefix) is
+// run WARMUP times and then N more times, and the wall times of the last
+// N runs are reported (see report_bench). $? and $PIPESTATUS come from
+// the last run, and time reports on the last run only. bench is also
+// ignored for a background pipeline, which then runs once.
+void
+execute_pipeline (stage_t *stages, size_t nstages, bool background)
 {
-  static pid_t pending_writer = -1;
+  double expanding = trace_now ();
+  expand_stages (stages, nstages);
+  trace_span ("expand", "parse", expanding, NULL);
 
-  if (!run_builtin (str, cmd))
+  bool timed = false;
+  while (stages[0].builtin == BUILTIN_TIME && stages[0].argv[1] != NULL)
     {
-      if (fd[0] == -1)
-        {
-          pid_t pid = fork ();
-          if (pid == -1)
-            {
-              return -1;
-            }
-          if (pid == 0)
-            {
-              char **env = build_env ();
-              char *resolved = resolve_path (cmd[0]);
-              execve (resolved, cmd, env);
-              free (resolved);
-              exit (1);
-            }
-          if (pid > 0)
-            {
-              int status;
-              if (waitpid (pid, &status, 0) == -1)
-                return -1;
-              if (WIFEXITED (status))
-                return WEXITSTATUS (status);
-              return -1;
-            }
-        }
+      // "time cmd args" becomes "cmd args"
+      stages[0].argv++;
+      stages[0].builtin = builtin_lookup (stages[0].argv[0]);
+      timed = !background;
+    }
+
+  int *statuses = arena_calloc (nstages, sizeof (int));
+  size_t runs = 1;
+  size_t warmup = 0;
+  bool benched = false;
+  // A malformed bench is left in place, and running it prints the usage
+  if (stages[0].builtin == BUILTIN_BENCH && stages[0].argv[1] != NULL
+      && strip_bench (&stages[0], &runs, &warmup))
+    {
+      if (background)
+        runs = 1, warmup = 0;
       else
-        {
-          if (process_num == 1)
-            {
-              process_num = 2;
-              pid_t pid = fork ();
-              if (pid == -1)
-                {
-                  return -1;
-                }
-              if (pid == 0)
-                {
-                  close (fd[0]);
-                  dup2 (fd[1], STDOUT_FILENO);
-                  close (fd[1]);
-
-                  char **env = build_env ();
-                  char *resolved = resolve_path (cmd[0]);
-                  execve (resolved, cmd, env);
-                  free (resolved);
-                  exit (1);
-                }
-              else
-                {
-                  pending_writer = pid;
-                  close (fd[1]);
-                  return 0;
-                }
-            }
-          else
-            {
-              process_num = 1;
-              pid_t reader_pid = fork ();
-              if (reader_pid == -1)
-                {
-                  return -1;
-                }
-
-              if (reader_pid == 0)
-                {
-                  close (fd[1]);
-                  dup2 (fd[0], STDIN_FILENO);
-                  close (fd[0]);
-
-                  char **env = build_env ();
-                  char *resolved = resolve_path (cmd[0]);
-                  execve (resolved, cmd, env);
-
-                  free (resolved);
-                  exit (1);
-                }
-              else
-                {
-                  close (fd[0]);
-                  fd[0] = fd[1] = -1;
-
-                  int status;
-                  int ret_code = 0;
-
-                  waitpid (reader_pid, &status, 0);
-
-                  if (pending_writer != -1)
-                    {
-                      waitpid (pending_writer, &status, 0);
-                      pending_writer = -1;
-                    }
-
-                  return ret_code;
-                }
-            }
-        }
+        benched = true;
+    }
+
+  struct rusage *usage = NULL;
+  if (timed)
+    usage = arena_calloc (nstages, sizeof (struct rusage));
+  double *times = arena_alloc (runs * sizeof (double));
+  size_t codes[BENCH_CODES] = { 0 };
+  struct timespec start;
+  struct timespec end;
+  for (size_t i = 0; i < warmup + runs; i++)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      double traced = trace_now ();
+      run_pipeline (stages, nstages, statuses, background, usage);
+      trace_span ("pipeline", "exec", traced, NULL);
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      if (i < warmup)
+        continue;
+
+      times[i - warmup] = (end.tv_sec - start.tv_sec)
+                          + (end.tv_nsec - start.tv_nsec) / 1e9;
+      int rc = statuses[nstages - 1];
+      codes[(rc >= -1 && rc + 1 < BENCH_CODES) ? rc + 1 : 0]++;
     }
-  return 0;
+  if (timed && runs > 0)
+    report_usage (stages, nstages, usage, times[runs - 1]);
+  if (benched)
+    report_bench (times, runs, codes);
+
+  // Each status takes at most 12 characters plus a separator
+  char *pipestatus = arena_alloc (nstages * 13);
+  char *next = pipestatus;
+  for (size_t i = 0; i < nstages; i++)
+    next += sprintf (next, i == 0 ? "%d" : " %d", statuses[i]);
+  hash_insert (shell_vars, "PIPESTATUS", pipestatus);
+
+  char rc_str[20];
+  snprintf (rc_str, 20, "%d", statuses[nstages - 1]);
+  hash_insert (shell_vars, "?", rc_str);
 }
@@ -1,17 +1,38 @@
 #ifndef __cs361_process__
 #define __cs361_process__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/resource.h>
+
+#include "builtins.h"
+
 // The contents of this file are up to you, but they should be related to
 // running separate processes. It is recommended that you have functions
 // for:
 //   - performing a $PATH lookup
 //   - determining if a command is a built-in or executable
 //   - running a single command in a second process
-//   - running a pair of commands that are connected with a pipe
+//   - running a pipeline of commands connected with pipes
 
 // You should provide some function like this to serve as the interface to
 // parsing the command line. This function is just a placeholder and you
 // should define your own.
-int run_process (char *str, char *cmd[], int fd[]);
+
+// Selects the fork()+execve() launcher instead of posix_spawn()
+extern bool use_fork;
+
+// One command of a pipeline
+typedef struct stage
+{
+  char **argv;       // NULL-terminated argument list
+  builtin_t builtin; // builtin to run, or BUILTIN_NONE for a program
+  char *in_file;     // file to read STDIN from (< FILE), or NULL
+  char *out_file;    // file to write STDOUT to (> or >> FILE), or NULL
+  bool append;       // out_file was given with >>
+} stage_t;
+
+void execute_pipeline (stage_t *, size_t, bool);
+int run_pipeline (stage_t *, size_t, int *, bool, struct rusage *);
 
 #endif
@@ -1,46 +1,214 @@
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "builtins.h"
 #include "cmd.h"
+#include "compile.h"
 #include "hash.h"
+#include "jobs.h"
+#include "pathcache.h"
 #include "process.h"
+#include "trace.h"
+#include "tools.h"
 
-// No command line can be more than 100 characters
-#define MAXLENGTH 100
+// Block size used when a script cannot be mapped (pipes, devices)
+#define READ_BLOCK 65536
 
-void
-shell (FILE *input)
+// Run -b scripts through the compiled script cache (see compile.c)
+bool use_script_cache = true;
+
+// The shell's variables (see export and unset)
+hash_t *shell_vars = NULL;
+
+static void interactive (void);
+static char *read_all (int, size_t *);
+static void run_line (char *);
+static bool run_script (const char *);
+static void run_lines (char *, size_t);
+
+/* Runs the shell on a script file, or interactively on STDIN if script is
+   NULL. Returns false if the script could not be read. */
+bool
+shell (const char *script)
+{
+  shell_vars = hash_new (100);
+  hash_insert (shell_vars, "?", "0");
+  jobs_init (script == NULL);
+  tools_init ();
+
+  bool ok = true;
+  if (script == NULL)
+    interactive ();
+  else
+    ok = run_script (script);
+
+  printf ("\n");
+  arena_destroy ();
+  path_cache_destroy ();
+  hash_free (shell_vars);
+  shell_vars = NULL;
+  return ok;
+}
+
+/* **********************************************************************
+ *                Helper functions only below this point                *
+ * ********************************************************************** */
+
+/* Reads commands from STDIN one line at a time, with no length limit */
+static void
+interactive (void)
 {
-  hash_init (100);
-  hash_insert ("?", "0");
-  char buffer[MAXLENGTH];
+  char *buffer = NULL;
+  size_t size = 0;
+  ssize_t len;
   while (1)
     {
+      // Report background jobs that finished since the last command
+      jobs_notify ();
+
       // Print the cursor and get the next command entered
-      if (input == stdin)
-        printf ("$ ");
-      memset (buffer, 0, sizeof (buffer));
-      if (fgets (buffer, MAXLENGTH, input) == NULL)
+      printf ("$ ");
+      fflush (stdout);
+      double start = trace_now ();
+      if ((len = getline (&buffer, &size, stdin)) == -1)
         break;
+      trace_span ("read", "input", start, NULL);
 
-      // here to resolve issues with different file inputs
-      if (input != stdin)
-        printf ("$ ");
-      if (input != stdin)
-        printf ("%s", buffer);
+      if (len > 0 && buffer[len - 1] == '\n')
+        buffer[len - 1] = '\0';
+      run_line (buffer);
+    }
+  free (buffer);
+}
 
-      // Keep this here to avoid weird line interleavings
-      fflush (stdout);
+/* Reads a whole stream with large read() calls. Used for scripts that
+   cannot be mapped. The result is NUL-terminated and must be freed. */
+static char *
+read_all (int fd, size_t *length)
+{
+  size_t cap = READ_BLOCK;
+  size_t len = 0;
+  char *data = malloc (cap + 1);
+  ssize_t got;
+  while ((got = read (fd, data + len, cap - len)) > 0)
+    {
+      len += got;
+      if (len == cap)
+        {
+          cap *= 2;
+          data = realloc (data, cap + 1);
+        }
+    }
+  data[len] = '\0';
+  *length = len;
+  return data;
+}
+
+/* Runs one command line; line must be NUL-terminated and writable */
+static void
+run_line (char *line)
+{
+  // The line is tokenized in place, so its text is recorded first
+  double start = trace_now ();
+  char *text = (start != 0) ? arena_strdup (line) : NULL;
+  path_cache_tick ();
+  parse_buffer (line);
+  trace_span ("line", "shell", start, text);
+  arena_reset ();
+}
+
+/* Runs every line of a script. Regular files are executed from their
+   compiled form unless the cache is disabled; otherwise they are mapped
+   privately, so lines are parsed in place (the newline becomes the
+   terminating NUL) without being copied. Other files are read in large
+   blocks. */
+static bool
+run_script (const char *path)
+{
+  struct stat st;
+  if (use_script_cache && stat (path, &st) == 0 && S_ISREG (st.st_mode))
+    return run_compiled (path);
+
+  int fd = open (path, O_RDONLY);
+  if (fd == -1)
+    {
+      perror (path);
+      return false;
+    }
+
+  if (fstat (fd, &st) == -1)
+    {
+      perror (path);
+      close (fd);
+      return false;
+    }
+
+  double start = trace_now ();
+  if (S_ISREG (st.st_mode) && st.st_size > 0)
+    {
+      size_t length = (size_t)st.st_size;
+      char *data = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                         fd, 0);
+      close (fd);
+      if (data == MAP_FAILED)
+        {
+          perror (path);
+          return false;
+        }
+      posix_madvise (data, length, POSIX_MADV_SEQUENTIAL);
+      trace_span ("read", "input", start, path);
+      run_lines (data, length);
+      munmap (data, length);
+      return true;
+    }
+
+  size_t length;
+  char *data = read_all (fd, &length);
+  close (fd);
+  trace_span ("read", "input", start, path);
+  run_lines (data, length);
+  free (data);
+  return true;
+}
+
+/* Splits a script into lines and runs them. Each line is echoed after
+   the prompt with a single buffered write; stdout is flushed only
+   before a child is launched, not after every line. */
+static void
+run_lines (char *data, size_t length)
+{
+  char *end = data + length;
+  char *line = data;
+  while (line < end)
+    {
+      // Report background jobs that finished since the last command
+      jobs_notify ();
+
+      char *nl = memchr (line, '\n', end - line);
+      size_t len = (nl != NULL) ? (size_t)(nl - line) : (size_t)(end - line);
+      printf ("$ %.*s\n", (int)len, line);
 
-      // Your code should begin here...
-      char *nl = strchr (buffer, '\n');
       if (nl != NULL)
         {
           *nl = '\0';
+          run_line (line);
+          line = nl + 1;
+          continue;
         }
-      parse_buffer (buffer);
+
+      // The last line has no newline to overwrite and may end exactly at
+      // the end of the mapping, so it gets a terminated copy
+      char *copy = arena_alloc (len + 1);
+      memcpy (copy, line, len);
+      copy[len] = '\0';
+      run_line (copy);
+      break;
     }
-  printf ("\n");
-  hash_destroy ();
 }
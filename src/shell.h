@@ -1,6 +1,13 @@
 #ifndef __cs361_shell__
 #define __cs361_shell__
 
-void shell (FILE *);
+#include <stdbool.h>
+
+#include "hash.h"
+
+extern bool use_script_cache;
+extern hash_t *shell_vars;
+
+bool shell (const char *);
 
 #endif
@@ -0,0 +1,151 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../utils/utils.h"
+#include "arena.h"
+#include "hash.h"
+#include "shell.h"
+#include "tools.h"
+
+// Utilities from utils/ that are linked into the shell. Running one of
+// them as a program costs a fork, an execve, dynamic linking and stdio
+// setup, which dwarfs the work on a small file. So when a command
+// resolves to one of the installed utilities, run_pipeline () calls it
+// like a builtin: in the shell itself, or in a forked child without an
+// exec when it is not the first stage of a pipeline.
+//
+// The utilities are installed in the bin directory: $DUKESH_BINDIR (a
+// shell variable, else from the environment) if it is set, otherwise the
+// ../bin of the directory holding the shell's own executable, where
+// src/Makefile and utils/Makefile put them. A command only runs in
+// process if it is the very file installed there, compared by device and
+// inode; a cat, cut, head or ls anywhere else (/bin/cat, ~/bin/cat,
+// bin/ls after a "cd") runs as a program. Setting DUKESH_BINDIR to an
+// empty or other directory ("export DUKESH_BINDIR=") turns this off.
+
+// A linked utility: its program name and its entry point
+typedef struct tool
+{
+  const char *name;
+  builtin_fn run;
+} tool_t;
+
+static const tool_t tools[] = {
+  { "cat", cat_main },
+  { "cut", cut_main },
+  { "head", head_main },
+  { "ls", ls_main },
+};
+
+#define NUM_TOOLS (sizeof (tools) / sizeof (tools[0]))
+
+// The installed file of each utility, as found by resolve_tools ()
+typedef struct installed
+{
+  bool found;
+  dev_t dev;
+  ino_t ino;
+} installed_t;
+
+static installed_t installed[NUM_TOOLS];
+static char *resolved = NULL;    // bin directory installed[] belongs to
+static char *default_dir = NULL; // ../bin next to the executable
+
+static const char *bin_dir_name (void);
+static void resolve_tools (void);
+
+/* Finds the shell's default bin directory and the utilities installed in
+   it. Called once when the shell starts, before any "cd". */
+void
+tools_init (void)
+{
+  char exe[PATH_MAX];
+  ssize_t len = readlink ("/proc/self/exe", exe, sizeof (exe) - 1);
+  if (len > 0)
+    {
+      exe[len] = '\0';
+      char *slash = strrchr (exe, '/');
+      if (slash != NULL)
+        {
+          *slash = '\0';
+          default_dir = malloc (strlen (exe) + sizeof ("/../bin"));
+          sprintf (default_dir, "%s/../bin", exe);
+        }
+    }
+  resolve_tools ();
+}
+
+/* Returns the entry point of the utility at path (as resolved for
+   execution), or NULL if path is not a linked utility installed in the
+   bin directory. Only a path whose last component names a utility costs
+   more than a few comparisons, and then one stat (). */
+builtin_fn
+tool_lookup (const char *path)
+{
+  if (path == NULL)
+    return NULL;
+
+  const char *slash = strrchr (path, '/');
+  const char *name = (slash != NULL) ? slash + 1 : path;
+  size_t i = 0;
+  while (i < NUM_TOOLS && strcmp (name, tools[i].name) != 0)
+    i++;
+  if (i == NUM_TOOLS)
+    return NULL;
+
+  resolve_tools ();
+  struct stat st;
+  if (!installed[i].found || stat (path, &st) == -1
+      || st.st_dev != installed[i].dev || st.st_ino != installed[i].ino)
+    return NULL;
+  return tools[i].run;
+}
+
+/* **********************************************************************
+ *                Helper functions only below this point                *
+ * ********************************************************************** */
+
+/* Returns the name of the bin directory, which may be empty */
+static const char *
+bin_dir_name (void)
+{
+  const char *bindir = NULL;
+  if (shell_vars != NULL)
+    bindir = hash_find (shell_vars, "DUKESH_BINDIR");
+  if (bindir == NULL)
+    bindir = getenv ("DUKESH_BINDIR");
+  if (bindir == NULL)
+    bindir = (default_dir != NULL) ? default_dir : "";
+  return bindir;
+}
+
+/* Records the device and inode of every utility installed in the bin
+   directory. The files are only stat'ed when the directory's name
+   differs from the one resolved last, so a relative DUKESH_BINDIR keeps
+   meaning the directory it named when it was set. */
+static void
+resolve_tools (void)
+{
+  const char *dir = bin_dir_name ();
+  if (resolved != NULL && strcmp (dir, resolved) == 0)
+    return;
+  free (resolved);
+  resolved = strdup (dir);
+
+  for (size_t i = 0; i < NUM_TOOLS; i++)
+    {
+      struct stat st;
+      char *file = arena_alloc (strlen (dir) + strlen (tools[i].name) + 2);
+      sprintf (file, "%s/%s", dir, tools[i].name);
+      installed[i].found
+          = (dir[0] != '\0' && stat (file, &st) == 0 && S_ISREG (st.st_mode));
+      installed[i].dev = installed[i].found ? st.st_dev : 0;
+      installed[i].ino = installed[i].found ? st.st_ino : 0;
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef __cs361_tools__
+#define __cs361_tools__
+
+#include "builtins.h"
+
+void tools_init (void);
+builtin_fn tool_lookup (const char *);
+
+#endif
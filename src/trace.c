@@ -0,0 +1,139 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// Execution tracing in the Trace Event Format (the JSON read by Chrome's
+// about:tracing, Perfetto and speedscope). With -T FILE, the phases of
+// every command line (reading it, tokenizing, the FSM, building the
+// environment, resolving paths, spawning, waiting) are written to FILE as
+// complete ("X") events on the shell's own track. Each child gets a track
+// of its own, named after its stage, spanning from its launch until it
+// was reaped, so the stages of a pipeline show up side by side.
+//
+// When tracing is off, trace_now () returns 0 and the other functions
+// return at once, so trace points cost a branch.
+
+static FILE *out = NULL;     // the trace file, NULL when not tracing
+static bool first = true;    // no event written yet
+static struct timespec epoch; // time 0 of the trace
+static pid_t shell_pid;
+
+static void write_string (const char *);
+
+/* Starts writing a trace to path. Returns false if it cannot be
+   created. The trace is completed by trace_close (), which also runs
+   when the shell exits. */
+bool
+trace_open (const char *path)
+{
+  out = fopen (path, "w");
+  if (out == NULL)
+    return false;
+  // children must not inherit the trace file
+  fcntl (fileno (out), F_SETFD, FD_CLOEXEC);
+
+  clock_gettime (CLOCK_MONOTONIC, &epoch);
+  shell_pid = getpid ();
+  fprintf (out, "[\n");
+  fprintf (out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"dukesh\"}}",
+           (int)shell_pid, (int)shell_pid);
+  first = false;
+  atexit (trace_close);
+  return true;
+}
+
+/* Finishes the trace file. Only the shell itself writes to it; children
+   started with fork () leave with _exit (), which does not flush it. */
+void
+trace_close (void)
+{
+  if (out == NULL || getpid () != shell_pid)
+    return;
+  fprintf (out, "\n]\n");
+  fclose (out);
+  out = NULL;
+}
+
+/* Microseconds since the trace started, or 0 if not tracing */
+double
+trace_now (void)
+{
+  if (out == NULL)
+    return 0;
+
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - epoch.tv_sec) * 1e6
+         + (now.tv_nsec - epoch.tv_nsec) / 1e3;
+}
+
+/* Records a span of the shell from start (a trace_now () value) until
+   now. detail, if not NULL, is shown with the event (a command line, a
+   path, ...). */
+void
+trace_span (const char *name, const char *category, double start,
+            const char *detail)
+{
+  if (out == NULL)
+    return;
+
+  double end = trace_now ();
+  fprintf (out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+           first ? "" : ",\n", name, category, start, end - start,
+           (int)shell_pid, (int)shell_pid);
+  first = false;
+  if (detail != NULL)
+    {
+      fprintf (out, ",\"args\":{\"detail\":");
+      write_string (detail);
+      fprintf (out, "}");
+    }
+  fprintf (out, "}");
+}
+
+/* Records the lifetime of a child on a track of its own, labelled with
+   its command */
+void
+trace_track (pid_t child, const char *command, double start, double end)
+{
+  if (out == NULL)
+    return;
+
+  fprintf (out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":",
+           (int)shell_pid, (int)child);
+  write_string (command);
+  fprintf (out, "}},\n{\"name\":");
+  write_string (command);
+  fprintf (out, ",\"cat\":\"child\",\"ph\":\"X\",\"ts\":%.3f,"
+                "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+           start, end - start, (int)shell_pid, (int)child);
+}
+
+/* **********************************************************************
+ *                Helper functions only below this point                *
+ * ********************************************************************** */
+
+/* Writes a JSON string literal */
+static void
+write_string (const char *string)
+{
+  fputc ('"', out);
+  for (const unsigned char *c = (const unsigned char *)string; *c != '\0';
+       c++)
+    if (*c == '"' || *c == '\\')
+      fprintf (out, "\\%c", *c);
+    else if (*c < 0x20)
+      fprintf (out, "\\u%04x", *c);
+    else
+      fputc (*c, out);
+  fputc ('"', out);
+}
@@ -0,0 +1,13 @@
+#ifndef __cs361_trace__
+#define __cs361_trace__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+bool trace_open (const char *);
+void trace_close (void);
+double trace_now (void);
+void trace_span (const char *, const char *, double, const char *);
+void trace_track (pid_t, const char *, double, double);
+
+#endif
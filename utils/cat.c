@@ -1,42 +1,235 @@
+// copy_file_range () and splice () are Linux extensions
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// cat copies bytes, not lines, and lets the kernel move them whenever it
+// can, so the data never passes through this process:
+//
+//   output is a pipe                    splice ()
+//   input and output are regular files  copy_file_range ()
+//   input is a regular file             sendfile ()
+//   input is a pipe                     splice ()
+//
+// Whenever the kernel refuses (an O_APPEND output, files on different
+// file systems with older kernels, a terminal, ...), the rest of the
+// input is copied with read () and write () through a large buffer.
+// So is the rest of the input when splice () finds that the reader of
+// the output pipe has gone: cat then fails (or gets SIGPIPE) only if
+// there was something left to write, exactly as with write ().
 
-static void usage (void);
+// Most bytes handed to the kernel in one call; it caps them further
+#define KERNEL_CHUNK (1 << 30)
+
+// Size of the read ()/write () buffer
+#define BUFFER_SIZE (128 * 1024)
+
+// How a kernel-side copy ended
+typedef enum
+{
+  COPY_DONE,       // reached the end of the input
+  COPY_ERROR,      // reading or writing failed; errno says why
+  COPY_UNSUPPORTED // the kernel cannot do it here; copy some other way
+} copy_t;
 
+static bool copy_buffered (int, int);
+static bool copy_fd (int, int);
+static copy_t copy_kernel (int, int, bool);
+static copy_t copy_splice (int, int);
+static bool refused (int);
+static void usage (int);
+
+// Runs cat reading from in_fd and writing to out_fd (see utils.h). Each
+// FILE is copied in turn; with none, or for "-", in_fd is. A FILE that
+// cannot be opened gets the usage printed and is skipped.
 int
-main (int argc, char *argv[])
+cat_main (int argc, char *argv[], int in_fd, int out_fd)
 {
-  // get the file (only argument)
-  FILE *f = NULL;
-  if (argv[1])
+  int rc = EXIT_SUCCESS;
+  if (argc < 2)
+    return copy_fd (in_fd, out_fd) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  for (int i = 1; i < argc; i++)
     {
-      f = fopen (argv[1], "r");
-      if (!f)
+      if (strcmp (argv[i], "-") == 0)
+        {
+          if (!copy_fd (in_fd, out_fd))
+            return EXIT_FAILURE;
+          continue;
+        }
+
+      int fd = open (argv[i], O_RDONLY | O_CLOEXEC);
+      if (fd == -1)
         {
           // if you cannot open the file, print the usage
-          usage ();
-          return EXIT_FAILURE;
+          usage (out_fd);
+          rc = EXIT_FAILURE;
+          continue;
         }
+      bool copied = copy_fd (fd, out_fd);
+      close (fd);
+      if (!copied)
+        return EXIT_FAILURE;
     }
-  else
+  return rc;
+}
+
+#ifndef UTILS_NO_MAIN
+int
+main (int argc, char *argv[])
+{
+  return cat_main (argc, argv, STDIN_FILENO, STDOUT_FILENO);
+}
+#endif
+
+// Copies everything left in in_fd to out_fd, by the first method in the
+// table above that applies. Returns false if reading or writing failed
+// (including a reader that went away).
+static bool
+copy_fd (int in_fd, int out_fd)
+{
+  struct stat in;
+  struct stat out;
+  copy_t result = COPY_UNSUPPORTED;
+  if (fstat (in_fd, &in) == -1 || fstat (out_fd, &out) == -1)
+    result = COPY_UNSUPPORTED;
+  else if (S_ISFIFO (out.st_mode))
+    result = copy_splice (in_fd, out_fd);
+  else if (S_ISREG (in.st_mode))
+    result = copy_kernel (in_fd, out_fd, S_ISREG (out.st_mode));
+  else if (S_ISFIFO (in.st_mode))
+    result = copy_splice (in_fd, out_fd);
+
+  if (result == COPY_UNSUPPORTED)
+    return copy_buffered (in_fd, out_fd);
+  return result == COPY_DONE;
+}
+
+// Copies with copy_file_range () (when the output is a regular file too)
+// or sendfile () from a regular input until its end. Returns
+// COPY_UNSUPPORTED, possibly after copying a part, when the kernel
+// refuses, so the caller can carry on from where this stopped.
+static copy_t
+copy_kernel (int in_fd, int out_fd, bool out_regular)
+{
+  bool ranges = out_regular;
+  while (true)
+    {
+      ssize_t n;
+      if (ranges)
+        n = copy_file_range (in_fd, NULL, out_fd, NULL, KERNEL_CHUNK, 0);
+      else
+        n = sendfile (out_fd, in_fd, NULL, KERNEL_CHUNK);
+      if (n > 0)
+        continue;
+      if (n == 0)
+        return COPY_DONE;
+      if (errno == EINTR)
+        continue;
+      if (!refused (errno))
+        return COPY_ERROR;
+      if (!ranges)
+        return COPY_UNSUPPORTED;
+      // sendfile () still works where copy_file_range () does not
+      ranges = false;
+    }
+}
+
+// Copies with splice (), which needs one end to be a pipe, until the end
+// of the input. Returns COPY_UNSUPPORTED as copy_kernel () does, and also
+// when the output pipe has no reader left. splice () raises SIGPIPE then
+// even at the end of the input, where write () would not have been
+// called at all, so the signal is ignored here and copy_buffered () is
+// left to find out whether anything remained to be written.
+static copy_t
+copy_splice (int in_fd, int out_fd)
+{
+  struct sigaction ignore;
+  struct sigaction saved;
+  memset (&ignore, 0, sizeof (ignore));
+  ignore.sa_handler = SIG_IGN;
+  sigemptyset (&ignore.sa_mask);
+  sigaction (SIGPIPE, &ignore, &saved);
+
+  copy_t result;
+  while (true)
     {
-      // if the file was not given, use stdin instead (piping)
-      f = stdin;
+      ssize_t n = splice (in_fd, NULL, out_fd, NULL, KERNEL_CHUNK,
+                          SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n > 0)
+        continue;
+      if (n == 0)
+        result = COPY_DONE;
+      else if (errno == EINTR)
+        continue;
+      else if (errno == EPIPE || refused (errno))
+        result = COPY_UNSUPPORTED;
+      else
+        result = COPY_ERROR;
+      break;
     }
 
-  // get and print every line of the file
-  char buffer[1024];
-  while (fgets (buffer, sizeof (buffer), f) != NULL)
+  sigaction (SIGPIPE, &saved, NULL);
+  return result;
+}
+
+// Whether a kernel-side copy failed with err because it cannot be done
+// on these files, rather than because of an I/O error
+static bool
+refused (int err)
+{
+  return err == EINVAL || err == ENOSYS || err == EXDEV
+         || err == EOPNOTSUPP || err == EBADF;
+}
+
+// Copies with read () and write () through a BUFFER_SIZE buffer. Returns
+// false if reading or writing failed.
+static bool
+copy_buffered (int in_fd, int out_fd)
+{
+  char *buffer = malloc (BUFFER_SIZE);
+  if (buffer == NULL)
+    return false;
+
+  bool ok = true;
+  while (ok)
     {
-      printf ("%s", buffer);
+      ssize_t got = read (in_fd, buffer, BUFFER_SIZE);
+      if (got == 0)
+        break;
+      if (got == -1)
+        {
+          ok = (errno == EINTR);
+          continue;
+        }
+      for (ssize_t done = 0; ok && done < got;)
+        {
+          ssize_t put = write (out_fd, buffer + done, got - done);
+          if (put > 0)
+            done += put;
+          else
+            ok = (put == -1 && errno == EINTR);
+        }
     }
-  return EXIT_SUCCESS;
+  free (buffer);
+  return ok;
 }
 
 // usage
 static void
-usage (void)
+usage (int fd)
 {
-  printf ("cat, print the contents of a file\n");
-  printf ("usage: cat FILE\n");
+  dprintf (fd, "cat, print the contents of a file\n");
+  dprintf (fd, "usage: cat [FILE ...]\n");
 }
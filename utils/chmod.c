@@ -4,10 +4,13 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#include "utils.h"
 
 static void usage (void);
 
-mode_t
+static mode_t
 parse_perms (const char *str, mode_t read, mode_t write, mode_t exec)
 {
   mode_t mode = 0;
@@ -20,8 +23,10 @@ parse_perms (const char *str, mode_t read, mode_t write, mode_t exec)
   return mode;
 }
 
+// Runs chmod (see utils.h); it only ever runs as a program, and prints
+// its usage on STDOUT
 int
-main (int argc, char **argv)
+chmod_main (int argc, char **argv, int in_fd, int out_fd)
 {
   if (argc < 3)
     {
@@ -46,6 +51,14 @@ main (int argc, char **argv)
   return 0;
 }
 
+#ifndef UTILS_NO_MAIN
+int
+main (int argc, char *argv[])
+{
+  return chmod_main (argc, argv, STDIN_FILENO, STDOUT_FILENO);
+}
+#endif
+
 static void
 usage (void)
 {
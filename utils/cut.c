@@ -3,14 +3,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
 
 // You may assume that lines are no longer than 1024 bytes
 #define LINELEN 1024
 
-static void usage (void);
+static void usage (FILE *);
 
+// Runs cut reading from in_fd and writing to out_fd (see utils.h)
 int
-main (int argc, char *argv[])
+cut_main (int argc, char *argv[], int in_fd, int out_fd)
 {
   // set a default delimiter and position
   char *d = " ";
@@ -21,6 +25,16 @@ main (int argc, char *argv[])
       return false;
     }
 
+  // the descriptor is used through a duplicate, so closing the stream
+  // leaves it open for the caller
+  FILE *out = fdopen (dup (out_fd), "w");
+  if (!out)
+    {
+      return EXIT_FAILURE;
+    }
+
+  // start over, as the shell may have run another utility before
+  optind = 0;
   opterr = 0;
   // provide he proper options
   char *optionStr = "d:f:";
@@ -42,13 +56,15 @@ main (int argc, char *argv[])
 
             if (*endptr != '\0' || val <= 0)
               {
-                usage ();
+                usage (out);
+                fclose (out);
                 return EXIT_FAILURE;
               }
             f = (int)val;
             if (f <= 0)
               {
-                usage ();
+                usage (out);
+                fclose (out);
                 return EXIT_FAILURE;
               }
 
@@ -56,7 +72,8 @@ main (int argc, char *argv[])
           }
         default:
           // check for invalid args
-          printf ("./bin/cut: invalid option -- \'%c\'\n", optopt);
+          fprintf (out, "./bin/cut: invalid option -- \'%c\'\n", optopt);
+          fclose (out);
           return false;
         }
     }
@@ -68,14 +85,20 @@ main (int argc, char *argv[])
       file = fopen (argv[optind], "r");
       if (!file)
         {
-          usage ();
+          usage (out);
+          fclose (out);
           return EXIT_FAILURE;
         }
     }
   else
     {
       // use stdin if no file can be found (piping)
-      file = stdin;
+      file = fdopen (dup (in_fd), "r");
+      if (!file)
+        {
+          fclose (out);
+          return EXIT_FAILURE;
+        }
     }
 
   char buffer[LINELEN];
@@ -100,28 +123,37 @@ main (int argc, char *argv[])
       // if that token is not NULL, and exsists, print it
       if (token && token != NULL)
         {
-          printf ("%s\n", token);
+          fprintf (out, "%s\n", token);
         }
       else
         {
           // print a newline otherwise
-          printf ("\n");
+          fprintf (out, "\n");
         }
     }
 
+  fclose (file);
+  fclose (out);
   return EXIT_SUCCESS;
 }
 
+#ifndef UTILS_NO_MAIN
+int
+main (int argc, char *argv[])
+{
+  return cut_main (argc, argv, STDIN_FILENO, STDOUT_FILENO);
+}
+#endif
+
 // usage
-static void usage (void) __attribute__ ((unused));
 static void
-usage (void)
+usage (FILE *out)
 {
-  printf ("cut, splits each line based on a delimiter\n");
-  printf ("usage: cut [FLAG] FILE\n");
-  printf ("FLAG can be:\n");
-  printf (
-      "  -d C     split each line based on the character C (default ' ')\n");
-  printf ("  -f N     print the Nth field (1 is first, default 1)\n");
-  printf ("If no FILE specified, read from STDIN\n");
+  fprintf (out, "cut, splits each line based on a delimiter\n");
+  fprintf (out, "usage: cut [FLAG] FILE\n");
+  fprintf (out, "FLAG can be:\n");
+  fprintf (out, "  -d C     split each line based on the character C "
+                "(default ' ')\n");
+  fprintf (out, "  -f N     print the Nth field (1 is first, default 1)\n");
+  fprintf (out, "If no FILE specified, read from STDIN\n");
 }
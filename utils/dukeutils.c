@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// Multicall build of the utilities: a single binary that runs the one
+// named by the file it was started through (argv[0], such as the
+// symlinks in ../bin/multi/), or by its first argument when started as
+// dukeutils itself ("dukeutils cat FILE"). All the utilities share one
+// executable, so a stream of short invocations keeps the same text pages
+// and a single binary warm in the page cache.
+
+static const struct util
+{
+  const char *name;
+  int (*run) (int, char *[], int, int);
+} utils[] = {
+  { "cat", cat_main },     { "chmod", chmod_main }, { "cut", cut_main },
+  { "env", env_main },     { "head", head_main },   { "ls", ls_main },
+  { "repeat", repeat_main },
+};
+
+#define NUM_UTILS (sizeof (utils) / sizeof (utils[0]))
+
+static void usage (void);
+
+int
+main (int argc, char *argv[])
+{
+  // dispatch on the file name of argv[0]
+  char *slash = strrchr (argv[0], '/');
+  char *name = slash ? slash + 1 : argv[0];
+  if (strcmp (name, "dukeutils") == 0
+      || strcmp (name, "dukeutils-static") == 0)
+    {
+      // "dukeutils cat FILE" runs as "cat FILE"
+      if (argc < 2)
+        {
+          usage ();
+          return EXIT_FAILURE;
+        }
+      argc--;
+      argv++;
+      slash = strrchr (argv[0], '/');
+      name = slash ? slash + 1 : argv[0];
+    }
+
+  for (size_t i = 0; i < NUM_UTILS; i++)
+    if (strcmp (name, utils[i].name) == 0)
+      return utils[i].run (argc, argv, STDIN_FILENO, STDOUT_FILENO);
+
+  usage ();
+  return EXIT_FAILURE;
+}
+
+// usage
+static void
+usage (void)
+{
+  printf ("dukeutils, all the utilities in one binary\n");
+  printf ("usage: dukeutils UTILITY [ARGS]\n");
+  printf ("   or: UTILITY [ARGS] (through a link named after it)\n");
+  printf ("UTILITY can be:");
+  for (size_t i = 0; i < NUM_UTILS; i++)
+    printf (" %s", utils[i].name);
+  printf ("\n");
+}
@@ -3,11 +3,18 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "utils.h"
+
+extern char **environ;
+
 static void usage (void);
 
+// Runs env (see utils.h); it only ever runs as a program, as it ends in
+// an execve (), and prints its usage on STDOUT
 int
-main (int argc, char *argv[], char *envp[])
+env_main (int argc, char *argv[], int in_fd, int out_fd)
 {
+  char **envp = environ;
   usage ();
 
   // Count existing environment variables
@@ -88,6 +95,14 @@ main (int argc, char *argv[], char *envp[])
   return EXIT_FAILURE;
 }
 
+#ifndef UTILS_NO_MAIN
+int
+main (int argc, char *argv[])
+{
+  return env_main (argc, argv, STDIN_FILENO, STDOUT_FILENO);
+}
+#endif
+
 static void
 usage (void)
 {
@@ -1,20 +1,40 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-// You may assume that lines are no longer than 1024 bytes
-#define LINELEN 1024
+#include "utils.h"
 
-static void usage (void);
+// head stops reading the moment it has everything it prints, and puts no
+// limit on the length of a line. A regular file is mapped and its
+// newlines found with memchr (). Any other input (a pipe, a terminal) is
+// read in BLOCK_SIZE blocks and scanned the same way, so head exits as
+// soon as the Nth line is complete and a writer upstream gets SIGPIPE
+// instead of streaming the rest of its output. A mapped input is left
+// positioned right after what was printed, as if only that was read.
 
+// Size of the blocks read from input that cannot be mapped
+#define BLOCK_SIZE (64 * 1024)
+
+static bool head_mapped (int, int, bool, long long, bool *);
+static bool head_read (int, int, bool, long long);
+static size_t scan (const char *, size_t, bool, long long *);
+static void usage (int);
+static bool write_all (int, const char *, size_t);
+
+// Runs head reading from in_fd and writing to out_fd (see utils.h)
 int
-main (int argc, char *argv[])
+head_main (int argc, char *argv[], int in_fd, int out_fd)
 {
   // set the default number of lines to print
-  int n = 5;
+  long long count = 5;
+  bool lines = true;
 
   // check if argv exsists
   if (!argv)
@@ -22,9 +42,11 @@ main (int argc, char *argv[])
       return false;
     }
 
+  // start over, as the shell may have run another utility before
+  optind = 0;
   opterr = 0;
-  char *optionStr = "n:";
-  char opt;
+  char *optionStr = "n:c:";
+  int opt;
 
   // get each argument
   while ((opt = getopt (argc, argv, optionStr)) != -1)
@@ -32,59 +54,163 @@ main (int argc, char *argv[])
       switch (opt)
         {
         case 'n':
+        case 'c':
           {
-            // if n is an arg, change the value of n
+            // -n counts lines and -c bytes; the last one given wins
             char *endptr;
-            long tmp = strtol (optarg, &endptr, 10);
-            n = (int)tmp;
+            count = strtoll (optarg, &endptr, 10);
+            lines = (opt == 'n');
             break;
           }
         default:
           // print if invalid arg is found
-          printf ("./bin/head: invalid option -- \'%c\'\n", optopt);
+          dprintf (out_fd, "./bin/head: invalid option -- \'%c\'\n",
+                   optopt);
           return false;
         }
     }
 
-  // get the file from the end of argv
-  FILE *f = NULL;
+  // get the file from the end of argv, or use stdin (piping)
+  int fd = in_fd;
   if (argv[optind])
     {
-      f = fopen (argv[optind], "r");
-      if (!f)
+      fd = open (argv[optind], O_RDONLY | O_CLOEXEC);
+      if (fd == -1)
         {
-          usage ();
+          usage (out_fd);
           return EXIT_FAILURE;
         }
     }
-  else
+
+  bool ok = true;
+  if (count > 0 && !head_mapped (fd, out_fd, lines, count, &ok))
+    ok = head_read (fd, out_fd, lines, count);
+
+  if (fd != in_fd)
+    close (fd);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#ifndef UTILS_NO_MAIN
+int
+main (int argc, char *argv[])
+{
+  return head_main (argc, argv, STDIN_FILENO, STDOUT_FILENO);
+}
+#endif
+
+// Prints the first count lines (or bytes) of fd from its current offset
+// by mapping it, and moves the offset past them. Only the pages that are
+// scanned are ever read. Sets *ok to whether the output was written.
+// Returns false, having done nothing, if fd is not a non-empty regular
+// file or cannot be mapped.
+static bool
+head_mapped (int fd, int out_fd, bool lines, long long count, bool *ok)
+{
+  struct stat st;
+  if (fstat (fd, &st) == -1 || !S_ISREG (st.st_mode))
+    return false;
+  off_t pos = lseek (fd, 0, SEEK_CUR);
+  if (pos == -1 || pos >= st.st_size)
+    return false;
+
+  // mmap () offsets must be page aligned
+  off_t base = pos - pos % sysconf (_SC_PAGESIZE);
+  size_t len = st.st_size - base;
+  char *map = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, base);
+  if (map == MAP_FAILED)
+    return false;
+
+  size_t skip = pos - base;
+  size_t used = scan (map + skip, len - skip, lines, &count);
+  *ok = write_all (out_fd, map + skip, used);
+  munmap (map, len);
+  lseek (fd, pos + used, SEEK_SET);
+  return true;
+}
+
+// Prints the first count lines (or bytes) of fd by reading it a block at
+// a time, and stops reading as soon as they are complete. Returns false
+// if reading or writing failed.
+static bool
+head_read (int fd, int out_fd, bool lines, long long count)
+{
+  char *buffer = malloc (BLOCK_SIZE);
+  if (buffer == NULL)
+    return false;
+
+  bool ok = true;
+  while (ok && count > 0)
     {
-      // use stdin if file was not provided (piping)
-      f = fdopen (STDIN_FILENO, "r");
+      ssize_t got = read (fd, buffer, BLOCK_SIZE);
+      if (got == 0)
+        break;
+      if (got == -1)
+        {
+          ok = (errno == EINTR);
+          continue;
+        }
+      size_t used = scan (buffer, got, lines, &count);
+      ok = write_all (out_fd, buffer, used);
     }
+  free (buffer);
+  return ok;
+}
 
-  char buffer[LINELEN];
-  int i = 0;
+// Finds how much of the len bytes at data to print, given that *left
+// lines (or bytes) are still wanted, and takes them off *left. A line
+// ends with its newline.
+static size_t
+scan (const char *data, size_t len, bool lines, long long *left)
+{
+  if (!lines)
+    {
+      size_t used = ((unsigned long long)*left < len) ? (size_t)*left : len;
+      *left -= used;
+      return used;
+    }
 
-  // retrieve n lines from the file
-  while (fgets (buffer, sizeof (buffer), f) != NULL && i < n)
+  const char *next = data;
+  const char *end = data + len;
+  while (*left > 0 && next < end)
     {
-      // print the line
-      printf ("%s", buffer);
-      i++;
+      const char *newline = memchr (next, '\n', end - next);
+      if (newline == NULL)
+        return len;
+      next = newline + 1;
+      (*left)--;
     }
+  return next - data;
+}
 
-  return EXIT_SUCCESS;
+// Writes len bytes to fd, however many write () calls it takes. Returns
+// false on an error, such as a pipe whose reader has exited.
+static bool
+write_all (int fd, const char *data, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t put = write (fd, data, len);
+      if (put == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+      data += put;
+      len -= put;
+    }
+  return true;
 }
 
 // usage
-static void usage (void) __attribute__ ((unused));
 static void
-usage (void)
+usage (int fd)
 {
-  printf ("head, prints the first few lines of a file\n");
-  printf ("usage: head [FLAG] FILE\n");
-  printf ("FLAG can be:\n");
-  printf ("  -n N     show the first N lines (default 5)\n");
-  printf ("If no FILE specified, read from STDIN\n");
+  dprintf (fd, "head, prints the first few lines of a file\n");
+  dprintf (fd, "usage: head [FLAG] FILE\n");
+  dprintf (fd, "FLAG can be:\n");
+  dprintf (fd, "  -n N     show the first N lines (default 5)\n");
+  dprintf (fd, "  -c N     show the first N bytes instead\n");
+  dprintf (fd, "If no FILE specified, read from STDIN\n");
 }
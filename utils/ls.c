@@ -10,8 +10,11 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
-static void usage (void);
+#include "utils.h"
+
+static void usage (FILE *);
 
 // WARNING WARNING WARNING:
 // When using opendir and readdir to read directory listings, the files
@@ -22,7 +25,7 @@ static void usage (void);
 
 // Function made using ChatGPT prompt: "Create a c function that sorts
 // filenames alphabetically, ignoring the leading ."
-int
+static int
 ignore_dotcmp (const struct dirent **a, const struct dirent **b)
 {
   const char *nameA = (*a)->d_name;
@@ -64,14 +67,25 @@ mode_to_string (mode_t mode, char *out)
   out[10] = '\0';
 }
 
+// Runs ls writing to out_fd (see utils.h); it reads no input
 int
-main (int argc, char *argv[])
+ls_main (int argc, char *argv[], int in_fd, int out_fd)
 {
   // possible arguments
   bool aOpt = false;
   bool pOpt = false;
   bool sOpt = false;
 
+  // the descriptor is used through a duplicate, so closing the stream
+  // leaves it open for the caller
+  FILE *out = fdopen (dup (out_fd), "w");
+  if (!out)
+    {
+      return EXIT_FAILURE;
+    }
+
+  // start over, as the shell may have run another utility before
+  optind = 0;
   opterr = 0;
   char *optionStr = "+aps";
   char opt;
@@ -93,13 +107,15 @@ main (int argc, char *argv[])
           break;
         default:
           // error message
-          printf ("./bin/ls: invalid option -- \'%c\'\n", optopt);
+          fprintf (out, "./bin/ls: invalid option -- \'%c\'\n", optopt);
+          fclose (out);
           return EXIT_FAILURE;
         }
     }
 
-  // get the directory we are checking
-  const char *dirpath = argv[optind];
+  // get the directory we are checking (the current one by default); a
+  // NULL path would crash scandir, and with it the shell running ls
+  const char *dirpath = argv[optind] ? argv[optind] : ".";
   struct dirent **namelist;
 
   // get the list of files from the directory
@@ -107,6 +123,7 @@ main (int argc, char *argv[])
   if (n == -1)
     {
       // files not found
+      fclose (out);
       return EXIT_FAILURE;
     }
 
@@ -151,7 +168,7 @@ main (int argc, char *argv[])
       // print the size of the files found if s is used
       if (sOpt)
         {
-          printf ("%ld ", st.st_size);
+          fprintf (out, "%ld ", st.st_size);
         }
 
       // print the permissions for each file
@@ -159,37 +176,46 @@ main (int argc, char *argv[])
         {
           char perm[11];
           mode_to_string (st.st_mode, perm);
-          printf ("%s ", perm);
+          fprintf (out, "%s ", perm);
         }
 
       // print the file name and free the entry from memory
-      printf ("%s\n", entry->d_name);
+      fprintf (out, "%s\n", entry->d_name);
       free (entry);
     }
   // free the allocated list of names
   free (namelist);
 
+  fclose (out);
   return EXIT_SUCCESS;
 }
 
+#ifndef UTILS_NO_MAIN
+int
+main (int argc, char *argv[])
+{
+  return ls_main (argc, argv, STDIN_FILENO, STDOUT_FILENO);
+}
+#endif
+
 // usage
-static void usage (void) __attribute__ ((unused));
+static void usage (FILE *) __attribute__ ((unused));
 static void
-usage (void)
+usage (FILE *out)
 {
-  printf ("ls, list directory contents\n");
-  printf ("usage: ls [FLAG ...] [DIR]\n");
-  printf ("FLAG is one or more of:\n");
-  printf ("  -a       list all files (even hidden ones)\n");
-  printf ("  -p       list permission bitmask\n");
-  printf ("  -s       list file sizes\n");
-  printf ("If no DIR specified, list current directory contents.\n\n");
-  printf ("Files must be sorted alphabetically, case insensitive.\n");
-  printf ("Leading dots should be ignored when sorting.\n\n");
-  printf ("With the -s flag, do not show entries for subdirectories.\n");
-  printf ("Permission bitmasks are 10-character strings such as:\n");
-  printf ("  -rwxr-x---\n\n");
-  printf (
-      "The first character is d for directories and - for regular files.\n\n");
-  printf ("Do not show the \".\" or \"..\" directory entries.\n");
+  fprintf (out, "ls, list directory contents\n");
+  fprintf (out, "usage: ls [FLAG ...] [DIR]\n");
+  fprintf (out, "FLAG is one or more of:\n");
+  fprintf (out, "  -a       list all files (even hidden ones)\n");
+  fprintf (out, "  -p       list permission bitmask\n");
+  fprintf (out, "  -s       list file sizes\n");
+  fprintf (out, "If no DIR specified, list current directory contents.\n\n");
+  fprintf (out, "Files must be sorted alphabetically, case insensitive.\n");
+  fprintf (out, "Leading dots should be ignored when sorting.\n\n");
+  fprintf (out, "With the -s flag, do not show entries for subdirectories.\n");
+  fprintf (out, "Permission bitmasks are 10-character strings such as:\n");
+  fprintf (out, "  -rwxr-x---\n\n");
+  fprintf (out, "The first character is d for directories and - for "
+                "regular files.\n\n");
+  fprintf (out, "Do not show the \".\" or \"..\" directory entries.\n");
 }
@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#include "utils.h"
 
-#include "../src/hash.c"
 static void usage (void);
 
+// Runs repeat (see utils.h); it only ever runs as a program, and prints
+// on STDOUT
 int
-main (int argc, char *argv[], char *envp[])
+repeat_main (int argc, char *argv[], int in_fd, int out_fd)
 {
   if (argc < 3)
     {
@@ -33,6 +37,14 @@ main (int argc, char *argv[], char *envp[])
   return EXIT_SUCCESS;
 }
 
+#ifndef UTILS_NO_MAIN
+int
+main (int argc, char *argv[])
+{
+  return repeat_main (argc, argv, STDIN_FILENO, STDOUT_FILENO);
+}
+#endif
+
 static void
 usage (void)
 {
@@ -0,0 +1,23 @@
+#ifndef __cs361_utils__
+#define __cs361_utils__
+
+// Entry points of the utilities, for the multicall binary (see
+// dukeutils.c) and for those dukesh links in and runs without an exec
+// (see src/tools.c). Each takes its arguments, the descriptor to read
+// its input from and the one to write its output to, and returns its
+// exit status. The descriptors stay open.
+//
+// Only cat, cut, head and ls honor the descriptors. chmod, env and repeat
+// only ever run as programs and use STDIN and STDOUT.
+//
+// Compiled with UTILS_NO_MAIN, a utility leaves out its main ().
+
+int cat_main (int, char *[], int, int);
+int chmod_main (int, char *[], int, int);
+int cut_main (int, char *[], int, int);
+int env_main (int, char *[], int, int);
+int head_main (int, char *[], int, int);
+int ls_main (int, char *[], int, int);
+int repeat_main (int, char *[], int, int);
+
+#endif